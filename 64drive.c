@@ -30,7 +30,7 @@ void loadRomToRam(uint32_t ramaddr, uint32_t clus)
    uint32_t start_sector;
    uint32_t clusters;
    
-   while (start_cluster < 0x0ffffff8) {
+   while (start_cluster < 0x0ffffff7) {
        next_cluster = fat_get_fat(current_cluster);
 
        // contiguous so far, keep copying
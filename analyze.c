@@ -0,0 +1,111 @@
+#include <err.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "tools.h"
+
+/*
+ * Fragmentation report for an image. Lists how many extents each file is in,
+ * which is also how many cfSectorsToRam commands loadRomToRam issues to load
+ * it, and how the free space is laid out.
+ *
+ * With -m the output is one tab-separated record per line, for scripts:
+ *  file    <path> <bytes> <clusters> <extents>
+ *  free    <free clusters> <free runs> <largest run>
+ *  total   <files> <fragmented files> <extents> <cluster bytes>
+ */
+
+static int machine = 0;
+
+static uint32_t total_files = 0, total_fragmented = 0, total_extents = 0;
+
+/**
+ * Report one file.
+ */
+static void report(const char *path, fat_dirent *de) {
+    uint32_t clusters, extents;
+
+    if (file_layout(de, &clusters, &extents) != 0) {
+        warnx("%s: cluster chain is damaged, run fsck", path);
+        return;
+    }
+
+    ++total_files;
+    total_extents += extents;
+    if (extents > 1)
+        ++total_fragmented;
+
+    if (machine)
+        printf("file\t%s\t%u\t%u\t%u\n", path, de->size, clusters, extents);
+    else
+        printf("%6u extents %10u bytes  %s\n", extents, de->size, path);
+}
+
+/**
+ * Scan the whole FAT for runs of free clusters.
+ */
+static void free_stats(uint32_t *free_clusters, uint32_t *runs, uint32_t *largest) {
+    uint32_t cluster, run = 0;
+
+    *free_clusters = *runs = *largest = 0;
+
+    for (cluster = 2; cluster < fat_fs.total_clusters + 2; ++cluster) {
+        if (fat_get_fat(cluster) == 0) {
+            if (run++ == 0)
+                ++*runs;
+            ++*free_clusters;
+            if (run > *largest)
+                *largest = run;
+        }
+        else
+            run = 0;
+    }
+}
+
+int main(int argc, char **argv) {
+    int ret, c;
+    uint32_t free_clusters, runs, largest, cluster_bytes;
+
+    while ((c = getopt(argc, argv, "m")) != -1)
+        switch (c) {
+            case 'm': machine = 1; break;
+            default: goto usage;
+        }
+
+    if (optind >= argc) {
+usage:
+        printf("Usage: %s [-m] <file_system.img>\n", argv[0]);
+        printf("    reports how fragmented each file and the free space are\n");
+        printf("    -m  tab-separated output for scripts\n");
+        return 1;
+    }
+
+    // hold the whole FAT in memory so it's read in big chunks, and skip the
+    // free bitmap since the free space is scanned here anyway
+    fat_config(&(fat_config_t){
+        .fat_table = FAT_CONF_ON,
+        .free_bitmap = FAT_CONF_OFF,
+    });
+
+    ret = fat_init(fat_disk_open(argv[optind]));
+    if (ret != 0)
+        errx(1, "%s", message1);
+
+    cluster_bytes = fat_fs.sect_per_clus * 512;
+
+    walk_files(fat_fs.root_cluster, "", report);
+    free_stats(&free_clusters, &runs, &largest);
+
+    if (machine) {
+        printf("free\t%u\t%u\t%u\n", free_clusters, runs, largest);
+        printf("total\t%u\t%u\t%u\t%u\n", total_files, total_fragmented, total_extents, cluster_bytes);
+    }
+    else {
+        printf("\n%u files, %u fragmented, %u extents\n", total_files, total_fragmented, total_extents);
+        printf("free space: %u clusters (%llu bytes) in %u runs, largest run %u clusters (%llu bytes)\n",
+                free_clusters, (unsigned long long)free_clusters * cluster_bytes,
+                runs, largest, (unsigned long long)largest * cluster_bytes);
+    }
+
+    return 0;
+}
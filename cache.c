@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+/*
+ * Set-associative LRU sector cache shared by the FAT, directory and file
+ * code. Each class of sector gets its own slice of the cache, so walking a
+ * FAT chain can never evict the directory sector someone is in the middle of
+ * editing.
+ *
+ * Entries hold a block of one or more consecutive sectors. FAT blocks span
+ * several sectors so chain walks need fewer requests. When the device can be
+ * mapped, entries point straight into the device instead of holding a copy.
+ */
+
+#define CACHE_INVALID 0xffffffff
+
+// sectors per block for each class
+#ifdef LINUX
+#define CACHE_FAT_BLOCK 16
+#else
+#define CACHE_FAT_BLOCK 4
+#endif
+
+typedef struct _cache_entry_t {
+    uint32_t block;     // first sector of the block, CACHE_INVALID if unused
+    uint32_t last_use;
+    uint32_t dirty;     // bitmask of dirty sectors in the block
+    unsigned char *data;
+} cache_entry_t;
+
+typedef struct _cache_class_t {
+    uint32_t block_sectors;
+    uint32_t sets;
+    uint32_t ways;
+    uint32_t clock;
+    uint32_t dirty_entries;
+    int write_error;    // a writeback failed since the last flush
+
+    cache_entry_t *entries;
+    unsigned char *mem;
+} cache_class_t;
+
+static cache_class_t cache[FAT_CACHE_CLASSES];
+
+uint32_t fat_data_gen = 0;
+
+/**
+ * Allocate one class of the cache, holding roughly the given number of
+ * sectors.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int _cache_init_class(cache_class_t *c, uint32_t sectors, uint32_t block_sectors, uint32_t ways) {
+    uint32_t i, count;
+
+    c->block_sectors = block_sectors;
+
+    // always room for at least two blocks, so the last one used survives
+    count = sectors / block_sectors;
+    if (count < 2)
+        count = 2;
+
+    if (ways > count)
+        ways = count;
+    c->ways = ways;
+    c->sets = count / ways;
+    count = c->sets * c->ways;
+
+    c->clock = 0;
+    c->dirty_entries = 0;
+
+    c->entries = malloc(count * sizeof(cache_entry_t));
+    c->mem = malloc((size_t)count * block_sectors * 512);
+    if (c->entries == NULL || c->mem == NULL)
+        return -1;
+
+    for (i = 0; i < count; ++i) {
+        c->entries[i].block = CACHE_INVALID;
+        c->entries[i].last_use = 0;
+        c->entries[i].dirty = 0;
+        c->entries[i].data = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * Set up the cache using the sizes in fat_conf. Throws away anything that
+ * was cached before.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int fat_cache_init(void) {
+    fat_cache_free();
+
+    if (_cache_init_class(&cache[FAT_CACHE_FAT], fat_conf.cache_fat_sectors, CACHE_FAT_BLOCK, fat_conf.cache_ways) != 0 ||
+        _cache_init_class(&cache[FAT_CACHE_DIR], fat_conf.cache_dir_sectors, 1, fat_conf.cache_ways) != 0 ||
+        _cache_init_class(&cache[FAT_CACHE_DATA], fat_conf.cache_data_sectors, 1, fat_conf.cache_ways) != 0) {
+        fat_cache_free();
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Release the cache's memory. Does NOT write back dirty sectors.
+ */
+void fat_cache_free(void) {
+    int i;
+
+    for (i = 0; i < FAT_CACHE_CLASSES; ++i) {
+        free(cache[i].entries);
+        free(cache[i].mem);
+        cache[i].entries = NULL;
+        cache[i].mem = NULL;
+    }
+}
+
+/**
+ * Write the dirty sectors of an entry to disk, one request per run of dirty
+ * sectors. FAT sectors are written to every copy of the FAT. A failed write
+ * is remembered until the next fat_cache_flush reports it.
+ */
+static void _cache_writeback(int class, cache_entry_t *e) {
+    cache_class_t *c = &cache[class];
+    uint32_t first, count, i;
+
+    if (e->dirty == 0)
+        return;
+
+    for (first = 0; first < c->block_sectors; first += count) {
+        // skip clean sectors
+        if (!(e->dirty & (1u << first))) {
+            count = 1;
+            continue;
+        }
+
+        for (count = 1; first + count < c->block_sectors && (e->dirty & (1u << (first + count))); ++count)
+            ;
+
+        if (cfWriteSectors(e->data + first * 512, e->block + first, count) != 0)
+            c->write_error = 1;
+
+        // mirror the FAT
+        if (class == FAT_CACHE_FAT)
+            for (i = 1; i < fat_fs.num_fats; ++i)
+                if (cfWriteSectors(e->data + first * 512, e->block + first + i * fat_fs.sect_per_fat, count) != 0)
+                    c->write_error = 1;
+    }
+
+    e->dirty = 0;
+    --c->dirty_entries;
+}
+
+/**
+ * Find the entry holding a block, NULL if it isn't cached.
+ */
+static cache_entry_t *_cache_lookup(cache_class_t *c, uint32_t block) {
+    cache_entry_t *set = &c->entries[(block / c->block_sectors) % c->sets * c->ways];
+    uint32_t i;
+
+    for (i = 0; i < c->ways; ++i)
+        if (set[i].block == block)
+            return &set[i];
+
+    return NULL;
+}
+
+/**
+ * Get a pointer to a cached sector, reading it from disk if need be. The
+ * pointer is good until the next call to fat_cache_get for the same class.
+ */
+unsigned char *fat_cache_get(int class, uint32_t lba) {
+    cache_class_t *c = &cache[class];
+    uint32_t block = lba - lba % c->block_sectors;
+    cache_entry_t *set, *e;
+    uint32_t i;
+
+    e = _cache_lookup(c, block);
+
+    // miss: replace the least recently used entry in the set
+    if (e == NULL) {
+        set = &c->entries[(block / c->block_sectors) % c->sets * c->ways];
+        e = &set[0];
+        for (i = 1; i < c->ways; ++i)
+            if (set[i].last_use < e->last_use)
+                e = &set[i];
+
+        _cache_writeback(class, e);
+
+        // read straight out of the device if we can
+        e->block = block;
+        e->data = cfMapSectors(block, c->block_sectors);
+        if (e->data == NULL) {
+            e->data = c->mem + (size_t)(e - c->entries) * c->block_sectors * 512;
+            cfReadSectors(e->data, block, c->block_sectors);
+        }
+
+        // chains mostly run forwards, so get the next FAT block on its way
+        if (class == FAT_CACHE_FAT)
+            cfPrefetch(block + c->block_sectors, c->block_sectors);
+    }
+
+    e->last_use = ++c->clock;
+
+    return e->data + (lba - block) * 512;
+}
+
+/**
+ * Mark a sector as modified. It must have just been returned by
+ * fat_cache_get.
+ */
+void fat_cache_dirty(int class, uint32_t lba) {
+    cache_class_t *c = &cache[class];
+    uint32_t block = lba - lba % c->block_sectors;
+    cache_entry_t *e = _cache_lookup(c, block);
+
+    if (e == NULL)
+        return;
+
+    if (e->dirty == 0)
+        ++c->dirty_entries;
+    e->dirty |= 1u << (lba - block);
+}
+
+/**
+ * Write back every dirty sector in a class. The sectors stay cached.
+ *
+ * Returns 0 on success, -1 if this or any writeback since the last flush
+ * failed.
+ */
+int fat_cache_flush(int class) {
+    cache_class_t *c = &cache[class];
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < c->sets * c->ways && c->dirty_entries > 0; ++i)
+        _cache_writeback(class, &c->entries[i]);
+
+    ret = c->write_error ? -1 : 0;
+    c->write_error = 0;
+
+    return ret;
+}
+
+/**
+ * Drop an entry that overlaps a run of sectors about to be overwritten.
+ */
+static void _cache_drop(int class, cache_entry_t *e, uint32_t lba, uint32_t count) {
+    cache_class_t *c = &cache[class];
+    uint32_t j, first, last, mask = 0;
+
+    // drop the dirty bits for the sectors being overwritten
+    first = e->block < lba ? lba - e->block : 0;
+    last = e->block + c->block_sectors > lba + count ? lba + count - e->block : c->block_sectors;
+    for (j = first; j < last; ++j)
+        mask |= 1u << j;
+
+    if (e->dirty != 0) {
+        e->dirty &= ~mask;
+        if (e->dirty == 0)
+            --c->dirty_entries;
+        else
+            _cache_writeback(class, e);
+    }
+
+    e->block = CACHE_INVALID;
+    e->last_use = 0;
+}
+
+/**
+ * Forget a run of sectors in all classes, because they are about to be
+ * written behind the cache's back. Dirty sectors inside the run are dropped,
+ * dirty sectors that merely share a block with it are written back first.
+ */
+void fat_cache_invalidate(uint32_t lba, uint32_t count) {
+    cache_class_t *c;
+    cache_entry_t *e;
+    uint32_t i, block, total;
+    int class;
+
+    // open files have to reload their sectors
+    ++fat_data_gen;
+
+    for (class = 0; class < FAT_CACHE_CLASSES; ++class) {
+        c = &cache[class];
+        total = c->sets * c->ways;
+
+        // short run: look up each block it touches
+        if (count / c->block_sectors + 2 < total) {
+            for (block = lba - lba % c->block_sectors; block < lba + count; block += c->block_sectors) {
+                e = _cache_lookup(c, block);
+                if (e != NULL)
+                    _cache_drop(class, e, lba, count);
+            }
+        }
+
+        // long run: cheaper to check every entry
+        else {
+            for (i = 0; i < total; ++i) {
+                e = &c->entries[i];
+                if (e->block != CACHE_INVALID && e->block < lba + count && e->block + c->block_sectors > lba)
+                    _cache_drop(class, e, lba, count);
+            }
+        }
+    }
+}
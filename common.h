@@ -13,9 +13,23 @@
 // dirents per sector
 #define DE_PER_SECTOR (512 / 32)
 
+// sector cache classes
+#define FAT_CACHE_FAT       0
+#define FAT_CACHE_DIR       1
+#define FAT_CACHE_DATA      2
+#define FAT_CACHE_CLASSES   3
+
 /**************
  * STRUCTURES *
  **************/
+// FSInfo fields, as they were last read from or written to disk
+typedef struct _fat_fsinfo_t {
+    int valid;              // sector has the right signature
+    uint32_t free_count;    // 0x1e8
+    uint32_t next_free;     // 0x1ec
+    unsigned char sector[512]; // kept so writing it back needs no read
+} fat_fsinfo_t;
+
 typedef struct _fat_fs_t {
     uint32_t info_sector;
     uint32_t begin_sector;
@@ -26,6 +40,9 @@ typedef struct _fat_fs_t {
     uint32_t clus_begin_sector;
     uint32_t total_clusters;
     uint32_t free_clusters;
+    uint32_t next_free;     // allocation hint, 0xffffffff if unknown
+
+    fat_fsinfo_t info;
 } fat_fs_t;
 
 typedef struct _fat_dirent {
@@ -58,14 +75,46 @@ typedef struct _fat_file_t {
     uint32_t size;
 } fat_file_t;
 */
+// a run of consecutive clusters in a file
+typedef struct _fat_extent_t {
+    uint32_t file_cluster;  // index of the first cluster within the file
+    uint32_t cluster;       // first cluster on disk
+    uint32_t length;        // in clusters
+} fat_extent_t;
+
 struct _fat_file_t {
     fat_dirent de;
     int dir;
 
-    uint32_t cluster;   // current cluster
-    uint32_t sector;    // current sector in cluster
-    int offset;         // offset in sector [0, 512)
     uint32_t position;  // absolute file position
+
+    // extent map, built the first time it's needed. stale unless extent_gen
+    // matches fat_chain_gen. freed by fat_close
+    fat_extent_t *extents;
+    uint32_t extent_count;
+    uint32_t extent_alloc;
+    uint32_t extent_gen;
+    uint32_t extent_last;   // where the last lookup landed
+
+    // the file's current sector, so open files don't evict each other. map
+    // points into the device if it can be mapped, otherwise the sector is
+    // copied into buffer. stale unless buffer_gen matches fat_data_gen
+    unsigned char buffer[512];
+    unsigned char *map;
+    uint32_t buffer_sector;
+    uint32_t buffer_gen;
+    int buffer_valid;
+
+    // everything from here to the end of the file reads as zeros, it's
+    // zeroed on disk by fat_close. 0xffffffff if nothing is
+    uint32_t zero_from;
+
+    // fat_preallocate may have left clusters past the end of the file,
+    // fat_close gives back the ones that weren't used
+    int reserved;
+
+    // fat_write has been used, fat_fsync or fat_close writes back the dirent
+    int dirty;
 };
 
 /*************
@@ -92,7 +141,15 @@ int fat_set_size(fat_dirent *de, uint32_t size);
 uint32_t fat_get_fat(uint32_t cluster);
 void fat_set_fat(uint32_t cluster, uint32_t value);
 int fat_allocate_cluster(uint32_t last_cluster, uint32_t *new_cluster);
-void fat_flush_fat(void);
+int fat_allocate_clusters(uint32_t last_cluster, uint32_t count, uint32_t *first_cluster);
+int fat_free_chain(uint32_t cluster);
+int fat_find_contiguous(uint32_t count, uint32_t *start);
+int fat_flush_fat(void);
+int fat_flush_fsinfo(void);
+int fat_table_init(void);
+void fat_table_free(void);
+int fat_free_map_init(void);
+void fat_free_map_free(void);
 
 /*
  * Directories
@@ -107,7 +164,7 @@ int fat_dir_create_file(const char *filename, fat_dirent *folder, fat_dirent *re
 
 // FIXME these should not be global
 // move them back into dir.c and make them static again
-void _fat_flush_dir(void);
+int _fat_flush_dir(void);
 void _fat_write_dirent(fat_dirent *de);
 
 /*
@@ -115,18 +172,54 @@ void _fat_write_dirent(fat_dirent *de);
  */
 void cfSectorToRam(uint32_t ramaddr, uint32_t lba);
 void cfSectorsToRam(uint32_t ramaddr, uint32_t lba, int sectors);
-void cfReadSector(unsigned char *buffer, uint32_t lba);
-void cfWriteSector(unsigned char *buffer, uint32_t lba);
+int cfReadSector(unsigned char *buffer, uint32_t lba);
+int cfReadSectors(unsigned char *buffer, uint32_t lba, uint32_t count);
+int cfWriteSector(unsigned char *buffer, uint32_t lba);
+int cfWriteSectors(unsigned char *buffer, uint32_t lba, uint32_t count);
+int cfClearSectors(uint32_t lba, uint32_t count);
+unsigned char *cfMapSector(uint32_t lba);
+unsigned char *cfMapSectors(uint32_t lba, uint32_t count);
+void cfPrefetch(uint32_t lba, uint32_t count);
+int cfFlush(void);
+int cfDiscard(uint32_t lba, uint32_t count);
 
 void cfSetCycleTime(int cycletime);
-int cfOptimizeCycleTime();
+int cfOptimizeCycleTime(unsigned char *first_sector);
 
-void fat_disk_open(char *filename);
+/*
+ * Sector cache
+ */
+int fat_cache_init(void);
+void fat_cache_free(void);
+unsigned char *fat_cache_get(int class, uint32_t lba);
+void fat_cache_dirty(int class, uint32_t lba);
+int fat_cache_flush(int class);
+void fat_cache_invalidate(uint32_t lba, uint32_t count);
+
+/*
+ * Lookup cache
+ */
+int fat_dcache_init(void);
+void fat_dcache_free(void);
+int fat_dcache_lookup(uint32_t parent, const char *name, fat_dirent *de);
+void fat_dcache_insert(uint32_t parent, const char *name, fat_dirent *de);
+void fat_dcache_insert_negative(uint32_t parent, const char *name);
+void fat_dcache_invalidate(uint32_t parent, const char *name);
+void fat_dcache_invalidate_dirent(fat_dirent *de);
+void fat_dcache_invalidate_dir(uint32_t parent);
+uint32_t fat_name_hash(uint32_t seed, const char *name);
+
+/*
+ * Directory name index
+ */
+int fat_dindex_find(fat_dirent *folder, const char *name);
+void fat_dindex_add(fat_dirent *pos, fat_dirent *de);
+void fat_dindex_free(void);
 
 /*
  * Etc.
  */
-int fat_get_sectors(uint32_t start_cluster, uint32_t *sectors, int size);
+void fat_open_from_dirent(fat_file_t *file, fat_dirent *de);
 int fat_get_sector(uint32_t start_cluster, uint32_t offset, uint32_t *sector, uint32_t *new_offset);
 
 /* Directory walking */
@@ -139,18 +232,22 @@ enum
 
 int fat_recurse_path(const char * const path, fat_dirent *dirent, int *ret_type, int type);
 
+// from disk.c
+extern fat_dev_t *fat_dev;
+
 // from fs.c
 extern char message1[4096];
 extern fat_fs_t fat_fs;
+extern fat_config_t fat_conf;
 
-// directory buffer
-extern unsigned char buffer[512];
-extern uint32_t dir_buffer_sector;
-extern int dir_buffer_dirty;
+// bumped whenever a file's cluster chain changes
+extern uint32_t fat_chain_gen;
 
-// fat buffer
-extern unsigned char fat_buffer[512];
-extern uint32_t fat_buffer_sector;
-extern int fat_buffer_dirty;
+// bumped whenever sectors are written behind the sector cache's back (from
+// cache.c)
+extern uint32_t fat_data_gen;
+
+// boot sector scratch buffer
+extern unsigned char buffer[512];
 
 #endif /* __COMMON_H__ */
@@ -0,0 +1,249 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+/*
+ * Lookup cache for fat_find_create. Maps (directory first cluster, name) to
+ * the dirent found there, so opening the same path over and over doesn't
+ * read the same directory sectors over and over. Names are compared without
+ * case, the same way fat_find_create does it.
+ *
+ * Names that weren't found are remembered too, so probing for the same
+ * missing file again and again doesn't scan the directory each time.
+ *
+ * Below this sits the per-directory name index in dindex.c, which makes the
+ * lookups that miss here cheap too.
+ *
+ * The cache is set-associative with LRU replacement within each set, like
+ * the sector cache.
+ */
+
+#define DCACHE_WAYS 4
+
+typedef struct _dcache_entry_t {
+    uint32_t parent;    // first cluster of the directory, 0 if unused
+    uint32_t hash;
+    uint32_t last_use;
+    int negative;       // name isn't in the directory, de only holds the name
+    fat_dirent de;
+} dcache_entry_t;
+
+static dcache_entry_t *dcache = NULL;
+static uint32_t dcache_sets = 0;
+static uint32_t dcache_clock = 0;
+
+static uint32_t dcache_hits = 0;
+static uint32_t dcache_negative_hits = 0;
+static uint32_t dcache_misses = 0;
+
+/**
+ * Set up the cache using the size in fat_conf. Throws away anything that was
+ * cached before.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int fat_dcache_init(void) {
+    fat_dcache_free();
+
+    dcache_sets = fat_conf.dcache_entries / DCACHE_WAYS;
+    if (dcache_sets == 0)
+        dcache_sets = 1;
+
+    dcache = calloc(dcache_sets * DCACHE_WAYS, sizeof(dcache_entry_t));
+    if (dcache == NULL) {
+        dcache_sets = 0;
+        return -1;
+    }
+
+    dcache_hits = dcache_negative_hits = dcache_misses = 0;
+
+    return 0;
+}
+
+/**
+ * Release the cache's memory.
+ */
+void fat_dcache_free(void) {
+    free(dcache);
+    dcache = NULL;
+    dcache_sets = 0;
+}
+
+/**
+ * Hash a case-folded name, mixed with a seed (FNV-1a).
+ */
+uint32_t fat_name_hash(uint32_t seed, const char *name) {
+    uint32_t hash = 2166136261u ^ seed;
+
+    for ( ; *name; ++name)
+        hash = (hash ^ (unsigned char)tolower((unsigned char)*name)) * 16777619u;
+
+    return hash;
+}
+
+/**
+ * Does a dirent go by a name? Either its long or short name will do.
+ */
+static int _dcache_match(fat_dirent *de, const char *name) {
+    return strcasecmp(de->short_name, name) == 0 ||
+        (de->long_name[0] && strcasecmp(de->long_name, name) == 0);
+}
+
+/**
+ * Find the entry for a name, NULL if it isn't cached.
+ */
+static dcache_entry_t *_dcache_find(uint32_t parent, const char *name, uint32_t hash) {
+    dcache_entry_t *set = &dcache[hash % dcache_sets * DCACHE_WAYS];
+    int i;
+
+    for (i = 0; i < DCACHE_WAYS; ++i)
+        if (set[i].parent == parent && set[i].hash == hash &&
+                _dcache_match(&set[i].de, name))
+            return &set[i];
+
+    return NULL;
+}
+
+/**
+ * Look up a name in a directory.
+ *
+ * Returns:
+ *  1   the name is cached, de is filled in
+ *  -1  the name is cached as not being in the directory
+ *  0   nothing cached for the name
+ */
+int fat_dcache_lookup(uint32_t parent, const char *name, fat_dirent *de) {
+    dcache_entry_t *e;
+
+    if (dcache == NULL)
+        return 0;
+
+    e = _dcache_find(parent, name, fat_name_hash(parent, name));
+    if (e == NULL) {
+        ++dcache_misses;
+        return 0;
+    }
+
+    e->last_use = ++dcache_clock;
+
+    if (e->negative) {
+        ++dcache_negative_hits;
+        return -1;
+    }
+
+    ++dcache_hits;
+
+    *de = e->de;
+    de->name = de->long_name[0] ? de->long_name : de->short_name;
+
+    return 1;
+}
+
+/**
+ * Get the entry to use for a name, reusing the least recently used entry in
+ * its set if it isn't cached.
+ */
+static dcache_entry_t *_dcache_slot(uint32_t parent, const char *name) {
+    uint32_t hash = fat_name_hash(parent, name);
+    dcache_entry_t *set, *e;
+    int i;
+
+    e = _dcache_find(parent, name, hash);
+    if (e == NULL) {
+        set = &dcache[hash % dcache_sets * DCACHE_WAYS];
+        e = &set[0];
+        for (i = 1; i < DCACHE_WAYS; ++i)
+            if (set[i].last_use < e->last_use)
+                e = &set[i];
+    }
+
+    e->parent = parent;
+    e->hash = hash;
+    e->last_use = ++dcache_clock;
+
+    return e;
+}
+
+/**
+ * Remember the dirent found for a name in a directory.
+ */
+void fat_dcache_insert(uint32_t parent, const char *name, fat_dirent *de) {
+    dcache_entry_t *e;
+
+    if (dcache == NULL)
+        return;
+
+    e = _dcache_slot(parent, name);
+    e->negative = 0;
+    e->de = *de;
+    e->de.name = NULL;
+}
+
+/**
+ * Remember that a name isn't in a directory. Creating the name has to
+ * replace or invalidate the entry.
+ */
+void fat_dcache_insert_negative(uint32_t parent, const char *name) {
+    dcache_entry_t *e;
+
+    if (dcache == NULL)
+        return;
+
+    e = _dcache_slot(parent, name);
+    e->negative = 1;
+    e->de.name = NULL;
+    e->de.short_name[0] = 0;
+    strncpy(e->de.long_name, name, sizeof(e->de.long_name) - 1);
+    e->de.long_name[sizeof(e->de.long_name) - 1] = 0;
+}
+
+/**
+ * Forget a name in a directory, because its dirent changed.
+ */
+void fat_dcache_invalidate(uint32_t parent, const char *name) {
+    dcache_entry_t *e;
+
+    if (dcache == NULL)
+        return;
+
+    e = _dcache_find(parent, name, fat_name_hash(parent, name));
+    if (e != NULL) {
+        e->parent = 0;
+        e->last_use = 0;
+    }
+}
+
+/**
+ * Forget a dirent under both of its names. It may have been looked up, and
+ * cached, by either one.
+ */
+void fat_dcache_invalidate_dirent(fat_dirent *de) {
+    fat_dcache_invalidate(de->first_cluster, de->short_name);
+    if (de->long_name[0])
+        fat_dcache_invalidate(de->first_cluster, de->long_name);
+}
+
+/**
+ * Forget everything cached for a directory.
+ */
+void fat_dcache_invalidate_dir(uint32_t parent) {
+    uint32_t i;
+
+    for (i = 0; i < dcache_sets * DCACHE_WAYS; ++i)
+        if (dcache[i].parent == parent) {
+            dcache[i].parent = 0;
+            dcache[i].last_use = 0;
+        }
+}
+
+/**
+ * Get the lookup cache's counts since fat_init: names found, names known not
+ * to exist, and lookups that had to read the directory.
+ */
+void fat_dcache_stats(uint32_t *hits, uint32_t *negative_hits, uint32_t *misses) {
+    *hits = dcache_hits;
+    *negative_hits = dcache_negative_hits;
+    *misses = dcache_misses;
+}
@@ -12,13 +12,14 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    fat_disk_open(argv[1]);
-
-    ret = fat_init();
+    ret = fat_init(fat_disk_open(argv[1]));
     if (ret != 0)
         errx(1, "%s", message1);
 
     fat_debug_readdir(fat_fs.root_cluster);
 
+    if (fat_unmount() != FAT_SUCCESS)
+        errx(1, "sync failed");
+
     return 0;
 }
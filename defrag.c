@@ -0,0 +1,240 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tools.h"
+
+/*
+ * Offline defragmenter. Moves every fragmented file into a single run of
+ * clusters, so the 64drive can load it with one cfSectorsToRam. Files named
+ * on the command line go first, then the rest from largest to smallest.
+ *
+ * Each file is copied to its new home, the new chain is written, then the
+ * dirent is pointed at it and only then is the old chain freed. A file with
+ * no free run big enough is left alone.
+ */
+
+typedef struct _defrag_file_t {
+    char path[1024];
+    fat_dirent de;
+    uint32_t clusters;
+    uint32_t extents;
+    int priority;
+} defrag_file_t;
+
+static defrag_file_t *files = NULL;
+static uint32_t file_count = 0, file_alloc = 0;
+
+// sectors copied per request
+#define COPY_SECTORS 256
+static unsigned char copy_buf[COPY_SECTORS * 512];
+
+/**
+ * Collect a file, unless its chain can't be trusted to copy.
+ */
+static void collect(const char *path, fat_dirent *de) {
+    defrag_file_t *f;
+
+    if (file_count == file_alloc) {
+        file_alloc = file_alloc ? file_alloc * 2 : 256;
+        files = realloc(files, file_alloc * sizeof(defrag_file_t));
+        if (files == NULL)
+            err(1, "realloc");
+    }
+
+    f = &files[file_count];
+    strcpy(f->path, path);
+    f->de = *de;
+    f->de.name = NULL;
+    f->priority = 0;
+
+    if (file_layout(de, &f->clusters, &f->extents) != 0) {
+        warnx("%s: cluster chain is damaged, skipped, run fsck", path);
+        return;
+    }
+
+    ++file_count;
+}
+
+// priority files first, then largest first
+static int cmp_files(const void *a, const void *b) {
+    const defrag_file_t *x = a, *y = b;
+
+    if (x->priority != y->priority)
+        return x->priority < y->priority ? -1 : 1;
+    if (x->clusters != y->clusters)
+        return x->clusters > y->clusters ? -1 : 1;
+    return 0;
+}
+
+static void report(const char *when) {
+    uint32_t i, fragmented = 0, extents = 0;
+
+    for (i = 0; i < file_count; ++i) {
+        extents += files[i].extents;
+        if (files[i].extents > 1)
+            ++fragmented;
+    }
+
+    printf("%s: %u files, %u fragmented, %u extents\n", when, file_count, fragmented, extents);
+}
+
+/**
+ * Copy a file's data into the run starting at dest, in order. Only the runs
+ * up to the end of the file are copied, so a chain that has grown a loop
+ * can't run on.
+ *
+ * Returns 0 on success, -1 on I/O error, -2 if the chain is damaged.
+ */
+static int copy_chain(defrag_file_t *f, uint32_t dest) {
+    uint32_t offset = 0, dest_sector = CLUSTER_TO_SECTOR(dest), done, n;
+    fat_file_extent_t run;
+    fat_file_t file;
+    int ret = 0, got = 0;
+
+    fat_open_from_dirent(&file, &f->de);
+
+    while (ret == 0 && (got = fat_get_extents(&file, &offset, &run, 1)) > 0) {
+        for (done = 0; done < run.count; done += n) {
+            n = run.count - done;
+            if (n > COPY_SECTORS)
+                n = COPY_SECTORS;
+
+            if (cfReadSectors(copy_buf, run.sector + done, n) != 0 ||
+                    cfWriteSectors(copy_buf, dest_sector, n) != 0) {
+                ret = -1;
+                break;
+            }
+            dest_sector += n;
+        }
+    }
+
+    if (ret == 0 && got < 0)
+        ret = -2;
+
+    fat_close(&file);
+    return ret;
+}
+
+/**
+ * Move a file into one run of clusters.
+ *
+ * Returns 1 if moved, 0 if there was no room, -1 on I/O error, -2 if the
+ * chain is damaged.
+ */
+static int move_file(defrag_file_t *f) {
+    uint32_t dest, i, old_start = f->de.start_cluster;
+    int ret;
+
+    if (fat_find_contiguous(f->clusters, &dest) != FAT_SUCCESS)
+        return 0;
+
+    fat_cache_invalidate(CLUSTER_TO_SECTOR(dest), f->clusters * fat_fs.sect_per_clus);
+    ret = copy_chain(f, dest);
+    if (ret != 0)
+        return ret;
+
+    // new chain, then the dirent, then free the old chain. each has to be
+    // on disk before the next, or the file could lose its data
+    for (i = 0; i < f->clusters - 1; ++i)
+        fat_set_fat(dest + i, dest + i + 1);
+    fat_set_fat(dest + f->clusters - 1, 0x0ffffff8);
+    fat_fs.free_clusters -= f->clusters;
+    if (fat_flush_fat() != 0)
+        return -1;
+
+    f->de.start_cluster = dest;
+    _fat_write_dirent(&f->de);
+    fat_dcache_invalidate_dir(f->de.first_cluster);
+    if (_fat_flush_dir() != 0)
+        return -1;
+
+    if (fat_free_chain(old_start) != FAT_SUCCESS)
+        return -2;
+
+    if (fat_sync() != FAT_SUCCESS)
+        return -1;
+
+    f->extents = 1;
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    int ret, c, dry_run = 0, verbose = 0;
+    uint32_t i, before;
+    char *image;
+
+    while ((c = getopt(argc, argv, "nv")) != -1)
+        switch (c) {
+            case 'n': dry_run = 1; break;
+            case 'v': verbose = 1; break;
+            default: goto usage;
+        }
+
+    if (optind >= argc) {
+usage:
+        printf("Usage: %s [-n] [-v] <file_system.img> [/path/to/file ...]\n", argv[0]);
+        printf("    makes every file on the image contiguous, the files listed first\n");
+        printf("    -n  only report what would be moved\n");
+        printf("    -v  list each file as it's moved\n");
+        return 1;
+    }
+
+    image = argv[optind++];
+
+    ret = fat_init(fat_disk_open(image));
+    if (ret != 0)
+        errx(1, "%s", message1);
+
+    walk_files(fat_fs.root_cluster, "", collect);
+
+    // files named on the command line go first, in the order given
+    for (c = optind; c < argc; ++c) {
+        for (i = 0; i < file_count; ++i)
+            if (strcasecmp(files[i].path, argv[c]) == 0)
+                break;
+        if (i == file_count)
+            warnx("%s: not found", argv[c]);
+        else
+            files[i].priority = c - optind - (argc - optind);
+    }
+
+    qsort(files, file_count, sizeof(defrag_file_t), cmp_files);
+
+    report("before");
+
+    for (i = 0; i < file_count; ++i) {
+        if (files[i].extents <= 1)
+            continue;
+
+        before = files[i].extents;
+
+        if (dry_run) {
+            if (verbose)
+                printf("  %s: %u extents\n", files[i].path, before);
+            continue;
+        }
+
+        ret = move_file(&files[i]);
+        if (ret == -2)
+            errx(1, "%s: cluster chain is damaged, run fsck", files[i].path);
+        if (ret < 0)
+            errx(1, "%s: I/O error", files[i].path);
+
+        if (ret == 0)
+            printf("  %s: no room for %u clusters, left at %u extents\n", files[i].path, files[i].clusters, before);
+        else if (verbose)
+            printf("  %s: %u -> 1 extents\n", files[i].path, before);
+    }
+
+    report(dry_run ? "after (dry run)" : "after");
+
+    free(files);
+
+    if (fat_unmount() != FAT_SUCCESS)
+        errx(1, "sync failed");
+
+    return 0;
+}
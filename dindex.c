@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+/*
+ * Name index for directories. The first lookup in a directory scans it once
+ * and records where each entry starts, hashed by both its long and short
+ * names. After that, finding a name (or finding out it isn't there) is a
+ * hash probe plus one fat_readdir, no matter how big the directory is.
+ *
+ * A handful of directories are indexed at a time, the least recently used
+ * index is thrown away to make room for a new one.
+ *
+ * Entries never move once written and new ones only go on the end, so an
+ * index stays good for as long as it's kept. Changing an entry in place
+ * (defrag moving a file's data) doesn't touch where it starts.
+ */
+
+#ifdef LINUX
+#define DINDEX_DIRS 16
+#else
+#define DINDEX_DIRS 2
+#endif
+
+// where an entry starts: the directory cursor before reading it
+typedef struct _dindex_pos_t {
+    uint32_t cluster;
+    uint16_t sector;
+    uint16_t index;
+} dindex_pos_t;
+
+typedef struct _dindex_slot_t {
+    uint32_t hash;
+    uint32_t pos;       // index into positions + 1, 0 if empty
+} dindex_slot_t;
+
+typedef struct _dindex_t {
+    uint32_t dir;       // first cluster of the directory, 0 if unused
+    uint32_t last_use;
+
+    dindex_pos_t *positions;
+    uint32_t count;
+    uint32_t allocated;
+
+    dindex_slot_t *slots;
+    uint32_t slot_count; // power of 2
+
+    dindex_pos_t end;   // end of directory
+} dindex_t;
+
+static dindex_t dindex[DINDEX_DIRS];
+static uint32_t dindex_clock = 0;
+
+/**
+ * Throw away a directory's index.
+ */
+static void _dindex_drop(dindex_t *d) {
+    free(d->positions);
+    free(d->slots);
+    memset(d, 0, sizeof(*d));
+}
+
+/**
+ * Throw away all indexes.
+ */
+void fat_dindex_free(void) {
+    int i;
+
+    for (i = 0; i < DINDEX_DIRS; ++i)
+        _dindex_drop(&dindex[i]);
+}
+
+static void _dindex_save(dindex_pos_t *pos, fat_dirent *de) {
+    pos->cluster = de->cluster;
+    pos->sector = de->sector;
+    pos->index = de->index;
+}
+
+static void _dindex_restore(fat_dirent *de, dindex_pos_t *pos) {
+    de->cluster = pos->cluster;
+    de->sector = pos->sector;
+    de->index = pos->index;
+}
+
+/**
+ * Add a name to the hash table. There's always a free slot.
+ */
+static void _dindex_hash(dindex_t *d, const char *name, uint32_t pos) {
+    uint32_t hash = fat_name_hash(0, name);
+    uint32_t i = hash & (d->slot_count - 1);
+
+    while (d->slots[i].pos != 0)
+        i = (i + 1) & (d->slot_count - 1);
+
+    d->slots[i].hash = hash;
+    d->slots[i].pos = pos;
+}
+
+/**
+ * Add an entry to an index, growing it if need be. The names are only
+ * needed to hash, the entry is found again by its position.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int _dindex_add(dindex_t *d, dindex_pos_t *pos, fat_dirent *de) {
+    dindex_pos_t *positions;
+    dindex_slot_t *slots;
+    uint32_t slot_count, i;
+
+    if (d->count == d->allocated) {
+        d->allocated = d->allocated ? d->allocated * 2 : 64;
+        positions = realloc(d->positions, d->allocated * sizeof(dindex_pos_t));
+        if (positions == NULL)
+            return -1;
+        d->positions = positions;
+    }
+
+    // two names per entry, keep the table under half full
+    if ((d->count + 1) * 4 > d->slot_count) {
+        slot_count = d->slot_count ? d->slot_count * 2 : 256;
+        slots = calloc(slot_count, sizeof(dindex_slot_t));
+        if (slots == NULL)
+            return -1;
+
+        // rehash from the old table
+        for (i = 0; i < d->slot_count; ++i)
+            if (d->slots[i].pos != 0) {
+                uint32_t j = d->slots[i].hash & (slot_count - 1);
+                while (slots[j].pos != 0)
+                    j = (j + 1) & (slot_count - 1);
+                slots[j] = d->slots[i];
+            }
+
+        free(d->slots);
+        d->slots = slots;
+        d->slot_count = slot_count;
+    }
+
+    d->positions[d->count++] = *pos;
+
+    _dindex_hash(d, de->short_name, d->count);
+    if (de->long_name[0])
+        _dindex_hash(d, de->long_name, d->count);
+
+    return 0;
+}
+
+/**
+ * Scan a directory from the start and build its index, replacing the least
+ * recently used one.
+ *
+ * Returns the index, NULL if out of memory or the directory can't be read.
+ */
+static dindex_t *_dindex_build(fat_dirent *folder) {
+    dindex_t *d = &dindex[0];
+    dindex_pos_t pos;
+    fat_dirent de = *folder;
+    int i, ret;
+
+    for (i = 1; i < DINDEX_DIRS; ++i)
+        if (dindex[i].last_use < d->last_use)
+            d = &dindex[i];
+
+    _dindex_drop(d);
+
+    _dindex_save(&pos, &de);
+    while ((ret = fat_readdir(&de)) > 0) {
+        if (_dindex_add(d, &pos, &de) != 0) {
+            _dindex_drop(d);
+            return NULL;
+        }
+        _dindex_save(&pos, &de);
+    }
+
+    if (ret < 0) {
+        _dindex_drop(d);
+        return NULL;
+    }
+
+    // reading more from the end of the directory finds nothing
+    _dindex_save(&d->end, &de);
+
+    d->dir = folder->first_cluster;
+    return d;
+}
+
+/**
+ * Look up a name in a directory using its index. The directory must be at
+ * its start.
+ *
+ * Returns:
+ *  1   found, folder holds the entry like after fat_readdir
+ *  0   not found, folder is at the end of the directory
+ *  -1  no index and it couldn't be built, folder is unchanged
+ */
+int fat_dindex_find(fat_dirent *folder, const char *name) {
+    dindex_t *d = NULL;
+    uint32_t hash, i;
+    int j;
+
+    for (j = 0; j < DINDEX_DIRS; ++j)
+        if (dindex[j].dir == folder->first_cluster)
+            d = &dindex[j];
+
+    if (d == NULL) {
+        d = _dindex_build(folder);
+        if (d == NULL)
+            return -1;
+    }
+
+    d->last_use = ++dindex_clock;
+
+    hash = fat_name_hash(0, name);
+    for (i = hash & (d->slot_count - 1); d->slot_count > 0 && d->slots[i].pos != 0; i = (i + 1) & (d->slot_count - 1)) {
+        if (d->slots[i].hash != hash)
+            continue;
+
+        _dindex_restore(folder, &d->positions[d->slots[i].pos - 1]);
+        if (fat_readdir(folder) > 0 &&
+                (strcasecmp(name, folder->short_name) == 0 ||
+                 strcasecmp(name, folder->long_name) == 0))
+            return 1;
+    }
+
+    _dindex_restore(folder, &d->end);
+    return 0;
+}
+
+/**
+ * Record an entry just created at the end of an indexed directory. pos is
+ * where the directory ended before, de is the new entry.
+ */
+void fat_dindex_add(fat_dirent *pos, fat_dirent *de) {
+    dindex_pos_t start;
+    int i;
+
+    for (i = 0; i < DINDEX_DIRS; ++i)
+        if (dindex[i].dir == pos->first_cluster) {
+            _dindex_save(&start, pos);
+            if (_dindex_add(&dindex[i], &start, de) != 0) {
+                _dindex_drop(&dindex[i]);
+                return;
+            }
+
+            // the end moves to just after the new entry
+            _dindex_save(&dindex[i].end, de);
+        }
+}
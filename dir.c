@@ -5,6 +5,10 @@
 
 #include "common.h"
 
+// the directory sector we're working on
+static unsigned char *dir_buffer;
+static uint32_t dir_buffer_sector;
+
 /**
  * Get the root directory entry.
  */
@@ -30,8 +34,14 @@ int fat_root_dirent(fat_dirent *dirent) {
  *  FAT_SUCCESS always
  */
 int fat_root(fat_file_t *file) {
-    fat_root_dirent(&file->de);
-    file->de.start_cluster = file->de.first_cluster;
+    fat_dirent de;
+
+    fat_root_dirent(&de);
+    de.start_cluster = de.first_cluster;
+
+    fat_open_from_dirent(file, &de);
+    file->dir = 1;
+
     return FAT_SUCCESS;
 }
 
@@ -45,26 +55,20 @@ void fat_sub_dirent(uint32_t start_cluster, fat_dirent *de) {
 
 /**
  * Flush pending changes to a directory.
+ *
+ * Returns 0 on success, -1 on I/O error.
  */
-void _fat_flush_dir(void) {
-    if (dir_buffer_dirty) {
-        cfWriteSector(buffer, dir_buffer_sector);
-        dir_buffer_dirty = 0;
-    }
+int _fat_flush_dir(void) {
+    return fat_cache_flush(FAT_CACHE_DIR);
 }
 
 /**
- * Read a sector from a directory. Automatically handles buffering and flushing
- * changes to dirty buffers.
+ * Read a sector from a directory. The sector cache takes care of flushing
+ * changes to dirty sectors.
  */
 static void _dir_read_sector(uint32_t sector) {
-    if (sector != dir_buffer_sector) {
-        // flush pending writes
-        _fat_flush_dir();
-
-        cfReadSector(buffer, sector);
-        dir_buffer_sector = sector;
-    }
+    dir_buffer = fat_cache_get(FAT_CACHE_DIR, sector);
+    dir_buffer_sector = sector;
 }
 
 /**
@@ -135,30 +139,30 @@ int fat_readdir(fat_dirent *dirent) {
         offset = dirent->index * 32;
 
         // end of directory reached
-        if (buffer[offset] == 0)
+        if (dir_buffer[offset] == 0)
             return 0;
 
         ++dirent->index;
 
         // deleted file, skip
-        if (buffer[offset] == 0xe5)
+        if (dir_buffer[offset] == 0xe5)
             continue;
 
-        attributes = buffer[offset + 0x0b];
+        attributes = dir_buffer[offset + 0x0b];
 
         // long filename, copy the bytes and move along
         if (attributes == 0x0f) {
-            segment = (buffer[offset] & 0x1F) - 1;
+            segment = (dir_buffer[offset] & 0x1F) - 1;
             if (segment > 19)
                 continue; // invalid segment
 
             dest = (dirent->long_name + segment * 13);
 
             for (i = 0; i < 5; ++i)
-                dest[i] = buffer[offset + 1 + i * 2];
+                dest[i] = dir_buffer[offset + 1 + i * 2];
 
             for (j = 0; j < 3; ++j)
-                dest[i+j] = buffer[offset + 0xe + j * 2];
+                dest[i+j] = dir_buffer[offset + 0xe + j * 2];
 
             // last segment can only have 9 characters
             if (segment == 19) {
@@ -167,12 +171,12 @@ int fat_readdir(fat_dirent *dirent) {
             }
 
             for ( ; j < 6; ++j)
-                dest[i+j] = buffer[offset + 0xe + j * 2];
+                dest[i+j] = dir_buffer[offset + 0xe + j * 2];
 
             i += j;
 
             for (j = 0; j < 2; ++j)
-                dest[i+j] = buffer[offset + 0x1c + j * 2];
+                dest[i+j] = dir_buffer[offset + 0x1c + j * 2];
 
             continue;
         }
@@ -181,13 +185,13 @@ int fat_readdir(fat_dirent *dirent) {
         dirent->volume_label = attributes & 0x08 ? 1 : 0;
 
         // you can thank FAT16 for this
-        dirent->start_cluster = shortEndian(buffer + offset + 0x14) << 16;
-        dirent->start_cluster |= shortEndian(buffer + offset + 0x1a);
+        dirent->start_cluster = shortEndian(dir_buffer + offset + 0x14) << 16;
+        dirent->start_cluster |= shortEndian(dir_buffer + offset + 0x1a);
 
-        dirent->size = intEndian(buffer + offset + 0x1c);
+        dirent->size = intEndian(dir_buffer + offset + 0x1c);
 
         // copy the name
-        memcpy(dirent->short_name, buffer + offset, 8);
+        memcpy(dirent->short_name, dir_buffer + offset, 8);
 
         // kill trailing space
         for (i = 8; i > 0 && dirent->short_name[i-1] == ' '; --i)
@@ -195,7 +199,7 @@ int fat_readdir(fat_dirent *dirent) {
 
         // get the extension
         dirent->short_name[i++] = '.';
-        memcpy(dirent->short_name + i, buffer + offset + 8, 3);
+        memcpy(dirent->short_name + i, dir_buffer + offset + 8, 3);
 
         // kill trailing space
         for (j = 3; j > 0 && dirent->short_name[i+j-1] == ' '; --j)
@@ -275,12 +279,12 @@ void fat_debug_readdir(uint32_t start_cluster) {
 
                 printf("  %d/%2d\n", sector_index, index/32);
 
-                if (buffer[index] == 0) {
+                if (dir_buffer[index] == 0) {
                     printf("end of dir marker, done\n");
                     return;
                 }
 
-                int attributes = buffer[index + 11];
+                int attributes = dir_buffer[index + 11];
                 printf("    %-30s %02x (%s filename)\n", "attributes:", attributes, attributes == 0x0f ? "long" : "short");
 
                 // LFN entry
@@ -288,22 +292,22 @@ void fat_debug_readdir(uint32_t start_cluster) {
                     int i, segment;
                     unsigned char buf[13], checksum;
 
-                    segment = (buffer[index] & 0x1F) - 1;
+                    segment = (dir_buffer[index] & 0x1F) - 1;
                     printf("    %-30s %d%s\n", "segment: ", segment, (segment < 0 || segment > 19) ? " (invalid)" : "");
 
                     // copy the bytes of the name
                     for (i = 0; i < 5; ++i)
-                        buf[i] = buffer[index + 1 + i * 2];
+                        buf[i] = dir_buffer[index + 1 + i * 2];
                     for (i = 0; i < 6; ++i)
-                        buf[5+i] = buffer[index + 0xe + i * 2];
+                        buf[5+i] = dir_buffer[index + 0xe + i * 2];
                     for (i = 0; i < 2; ++i)
-                        buf[11+i] = buffer[index + 0x1c + i * 2];
+                        buf[11+i] = dir_buffer[index + 0x1c + i * 2];
 
                     printf("    %-30s ", "bytes:");
                     printbuf(buf, 13);
 
                     // other info
-                    checksum = buffer[index + 13];
+                    checksum = dir_buffer[index + 13];
                     printf("    %-30s %02x\n", "checksum:", checksum);
                 }
 
@@ -312,26 +316,26 @@ void fat_debug_readdir(uint32_t start_cluster) {
                     unsigned char sum = 0;
 
                     printf("    %-30s ", "name:");
-                    printbuf(buffer + index, 8);
+                    printbuf(dir_buffer + index, 8);
 
                     printf("    %-30s ", "extension:");
-                    printbuf(buffer + index + 8, 3);
+                    printbuf(dir_buffer + index + 8, 3);
 
                     for (i = 0; i < 11; ++i)
-                        sum = (((sum & 1) << 7) | ((sum & 0xfe) >> 1)) + buffer[index + i];
+                        sum = (((sum & 1) << 7) | ((sum & 0xfe) >> 1)) + dir_buffer[index + i];
                     printf("    %-30s %02x\n", "checksum (calculated):", sum);
                 }
 
-                start_cluster = shortEndian(buffer + index + 0x14) << 16;
-                start_cluster |= shortEndian(buffer + index + 0x1a);
+                start_cluster = shortEndian(dir_buffer + index + 0x14) << 16;
+                start_cluster |= shortEndian(dir_buffer + index + 0x1a);
                 printf("    %-30s %u\n", "start cluster:", (unsigned int)start_cluster);
-                if (buffer[index] == 0xe5)
+                if (dir_buffer[index] == 0xe5)
                     printf("    %-30s\n", "deleted");
 
                 printf("        ");
-                printbuf(buffer + index, 16);
+                printbuf(dir_buffer + index, 16);
                 printf("        ");
-                printbuf(buffer + index + 16, 16);
+                printbuf(dir_buffer + index + 16, 16);
                 printf("    ----\n");
             }
         }
@@ -344,11 +348,8 @@ void fat_debug_readdir(uint32_t start_cluster) {
  * Fills a cluster with 0's.
  */
 static void _fat_clear_cluster(uint32_t cluster) {
-    unsigned char clear_buffer[512] = { 0, };
-    uint32_t i, sector = CLUSTER_TO_SECTOR(cluster);
-
-    for (i = 0; i < fat_fs.sect_per_clus; ++i)
-        cfWriteSector(clear_buffer, sector + i);
+    fat_cache_invalidate(CLUSTER_TO_SECTOR(cluster), fat_fs.sect_per_clus);
+    cfClearSectors(CLUSTER_TO_SECTOR(cluster), fat_fs.sect_per_clus);
 }
 
 /**
@@ -383,6 +384,7 @@ static int _fat_remaining_dirents(fat_dirent *dirent) {
  * Return:
  *  FAT_SUCCESS     success
  *  FAT_NOSPACE     file system full
+ *  FAT_IOERROR     writing the FAT failed
  */
 int fat_allocate_dirents(fat_dirent *dirent, int count) {
     int remaining, ret;
@@ -394,7 +396,8 @@ int fat_allocate_dirents(fat_dirent *dirent, int count) {
         if (ret == FAT_NOSPACE)
             return FAT_NOSPACE;
 
-        fat_flush_fat();
+        if (fat_flush_fat() != 0)
+            return FAT_IOERROR;
         _fat_clear_cluster(cluster);
     }
 
@@ -407,7 +410,7 @@ int fat_allocate_dirents(fat_dirent *dirent, int count) {
 void fat_init_dir(uint32_t cluster, uint32_t parent) {
     unsigned char buf[512] = { 0, };
     char name[11];
-    uint32_t i, sector = CLUSTER_TO_SECTOR(cluster);
+    uint32_t sector = CLUSTER_TO_SECTOR(cluster);
     uint16_t top16, bottom16;
 
     memset(name, 0x20, sizeof(name));
@@ -445,14 +448,13 @@ void fat_init_dir(uint32_t cluster, uint32_t parent) {
     //
     // write first sector
     //
+    fat_cache_invalidate(sector, fat_fs.sect_per_clus);
     cfWriteSector(buf, sector);
 
     //
     // zero the rest of the sectors
     //
-    memset(buf, 0, 32 * 2);
-    for (i = 1; i < fat_fs.sect_per_clus; ++i)
-        cfWriteSector(buf, sector + i);
+    cfClearSectors(sector + 1, fat_fs.sect_per_clus - 1);
 }
 
 /**
@@ -466,16 +468,16 @@ void _fat_write_dirent(fat_dirent *de) {
     _dir_read_sector(sector);
 
     // size
-    writeInt(&buffer[offset + 0x1c], de->size);
+    writeInt(&dir_buffer[offset + 0x1c], de->size);
 
     // start cluster
     top16 = (de->start_cluster >> 16 & 0xffff);
-    writeShort(&buffer[offset + 0x14], top16);
+    writeShort(&dir_buffer[offset + 0x14], top16);
 
     bottom16 = (de->start_cluster & 0xffff);
-    writeShort(&buffer[offset + 0x1a], bottom16);
+    writeShort(&dir_buffer[offset + 0x1a], bottom16);
 
-    dir_buffer_dirty = 1;
+    fat_cache_dirty(FAT_CACHE_DIR, dir_buffer_sector);
 }
 
 /**
@@ -522,7 +524,7 @@ static void _copy_lfn_segment(fat_dirent *de, char *long_name, int segment) {
         segment_chars[2*i+1] = 0xff;
     }
 
-    buf = &buffer[de->index * 32];
+    buf = &dir_buffer[de->index * 32];
     memset(buf, 0, 32);
 
     // copy the name
@@ -545,6 +547,7 @@ static void _copy_lfn_segment(fat_dirent *de, char *long_name, int segment) {
  * Returns:
  *  FAT_SUCCESS     success
  *  FAT_NOSPACE     not enough space to create the dirent and/or first cluster of a dir
+ *  FAT_IOERROR     writing the FAT failed
  *  FAT_INCONSISTENT    fs needs to be checked
  */
 int fat_dir_create_file(const char *filename, fat_dirent *folder, fat_dirent *result_de, int dir) {
@@ -586,6 +589,8 @@ int fat_dir_create_file(const char *filename, fat_dirent *folder, fat_dirent *re
     ret = fat_allocate_dirents(folder, num_dirents);
     if (ret == FAT_NOSPACE)
         return FAT_INCONSISTENT;
+    if (ret != FAT_SUCCESS)
+        return ret;
 
     _fat_load_dir_sector(folder);
     *result_de = *folder;
@@ -594,13 +599,13 @@ int fat_dir_create_file(const char *filename, fat_dirent *folder, fat_dirent *re
     for (segment = len / 13; segment >= 0; --segment) {
         _copy_lfn_segment(folder, long_name, segment);
 
-        buf = &buffer[folder->index * 32];
+        buf = &dir_buffer[folder->index * 32];
 
         buf[0] = (segment + 1) | ((segment == len / 13) << 6);
         buf[11] = 0x0f;
         buf[13] = crc;
 
-        dir_buffer_dirty = 1;
+        fat_cache_dirty(FAT_CACHE_DIR, dir_buffer_sector);
 
         // TODO check for inconsistency here
         ++folder->index;
@@ -610,7 +615,7 @@ int fat_dir_create_file(const char *filename, fat_dirent *folder, fat_dirent *re
     //
     // 8.3 dirent
     //
-    buf = &buffer[folder->index * 32];
+    buf = &dir_buffer[folder->index * 32];
     memset(buf, 0, 32);
 
     // copy the short name 
@@ -629,7 +634,8 @@ int fat_dir_create_file(const char *filename, fat_dirent *folder, fat_dirent *re
         fat_init_dir(start_cluster, folder->first_cluster);
 
         // flush the newly-allocated cluster
-        fat_flush_fat();
+        if (fat_flush_fat() != 0)
+            return FAT_IOERROR;
 
         // start cluster
         top16 = (start_cluster >> 16 & 0xffff);
@@ -654,7 +660,7 @@ int fat_dir_create_file(const char *filename, fat_dirent *folder, fat_dirent *re
     writeShort(&buf[22], time_field); // modify
     writeShort(&buf[24], date_field); // modify
 
-    dir_buffer_dirty = 1;
+    fat_cache_dirty(FAT_CACHE_DIR, dir_buffer_sector);
     _fat_flush_dir();
 
     fat_readdir(result_de);
@@ -1,8 +1,143 @@
+#ifdef LINUX
+#define _GNU_SOURCE // fallocate
+#endif
+
 #include <string.h>
 
 #include "common.h"
 #include "ci.h"
 
+// the device the file system is mounted on
+fat_dev_t *fat_dev;
+
+/**
+ * Read a sector from the mounted device. If there's an error, the buffer is
+ * filled with FF's.
+ *
+ * Returns 0 on success, nonzero on failure.
+ */
+int cfReadSector(unsigned char *buffer, uint32_t lba) {
+    return cfReadSectors(buffer, lba, 1);
+}
+
+/**
+ * Read a run of consecutive sectors in a single request. If there's an error,
+ * the buffer is filled with FF's.
+ *
+ * Returns 0 on success, nonzero on failure.
+ */
+int cfReadSectors(unsigned char *buffer, uint32_t lba, uint32_t count) {
+    int ret = fat_dev->read_sectors(fat_dev, buffer, lba, count);
+    if (ret != 0)
+        memset(buffer, 0xff, (size_t)count * 512);
+    return ret;
+}
+
+/**
+ * Write a sector to the mounted device.
+ *
+ * Returns 0 on success, nonzero on failure.
+ */
+int cfWriteSector(unsigned char *buffer, uint32_t lba) {
+    return cfWriteSectors(buffer, lba, 1);
+}
+
+/**
+ * Write a run of consecutive sectors in a single request.
+ *
+ * Returns 0 on success, nonzero on failure.
+ */
+int cfWriteSectors(unsigned char *buffer, uint32_t lba, uint32_t count) {
+    return fat_dev->write_sectors(fat_dev, buffer, lba, count);
+}
+
+// sectors of zeroes written per request by cfClearSectors
+#ifdef LINUX
+#define CLEAR_SECTORS 128
+#else
+#define CLEAR_SECTORS 8
+#endif
+
+/**
+ * Fill a run of consecutive sectors with 0's, using as few requests as
+ * possible.
+ *
+ * Returns 0 on success, nonzero on failure.
+ */
+int cfClearSectors(uint32_t lba, uint32_t count) {
+    static unsigned char zeroes[CLEAR_SECTORS * 512];
+    unsigned char *dest;
+    uint32_t run;
+    int ret;
+
+    // mapped device: just clear the memory
+    dest = cfMapSectors(lba, count);
+    if (dest != NULL) {
+        memset(dest, 0, (size_t)count * 512);
+        return 0;
+    }
+
+    while (count > 0) {
+        run = count < CLEAR_SECTORS ? count : CLEAR_SECTORS;
+
+        ret = cfWriteSectors(zeroes, lba, run);
+        if (ret != 0)
+            return ret;
+
+        lba += run;
+        count -= run;
+    }
+
+    return 0;
+}
+
+/**
+ * Get a pointer straight into the device for a sector, or NULL if the device
+ * can't be mapped. Writes through the pointer go to the device.
+ */
+unsigned char *cfMapSector(uint32_t lba) {
+    return cfMapSectors(lba, 1);
+}
+
+/**
+ * Get a pointer straight into the device for a run of sectors, or NULL if
+ * the device can't map them.
+ */
+unsigned char *cfMapSectors(uint32_t lba, uint32_t count) {
+    if (fat_dev->map_sectors == NULL)
+        return NULL;
+    return fat_dev->map_sectors(fat_dev, lba, count);
+}
+
+/**
+ * Hint that a run of sectors will be read soon, so the device can get started
+ * on it. NOP if the device doesn't support it.
+ */
+void cfPrefetch(uint32_t lba, uint32_t count) {
+    if (fat_dev->prefetch != NULL)
+        fat_dev->prefetch(fat_dev, lba, count);
+}
+
+/**
+ * Ask the device to make all previous writes durable. NOP if the device
+ * doesn't buffer writes.
+ */
+int cfFlush(void) {
+    if (fat_dev->flush == NULL)
+        return 0;
+    return fat_dev->flush(fat_dev);
+}
+
+/**
+ * Tell the device a range of sectors no longer holds useful data. Purely
+ * advisory, NOP if the device doesn't support it.
+ */
+int cfDiscard(uint32_t lba, uint32_t count) {
+    if (fat_dev->discard == NULL)
+        return 0;
+    return fat_dev->discard(fat_dev, lba, count);
+}
+
 #ifdef LINUX
 
 /****************************
@@ -10,11 +145,13 @@
  ***************************/
 
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
-
-// the disk image
-FILE *cf_file;
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void cfSectorToRam(uint32_t ramaddr, uint32_t lba) {
 }
@@ -22,48 +159,355 @@ void cfSectorToRam(uint32_t ramaddr, uint32_t lba) {
 void cfSectorsToRam(uint32_t ramaddr, uint32_t lba, int sectors) {
 }
 
-// read a sector 
-void cfReadSector(unsigned char *buffer, uint32_t lba) {
-    int ret = fseek(cf_file, lba * 512, SEEK_SET);
-    if (ret < 0)
-        goto error;
+// read sectors
+static int _stdio_read_sectors(fat_dev_t *dev, unsigned char *buffer, uint32_t lba, uint32_t count) {
+    FILE *cf_file = dev->priv;
 
-    size_t count = fread(buffer, 512, 1, cf_file);
-    if (count != 1)
-        goto error;
+    int ret = fseeko(cf_file, (off_t)lba * 512, SEEK_SET);
+    if (ret < 0)
+        return -1;
 
-    return;
+    size_t read = fread(buffer, 512, count, cf_file);
+    if (read != count)
+        return -1;
 
-error:
-    // if there's an error, return FF's
-    memset(buffer, 0xff, 512);
+    return 0;
 }
 
-void cfWriteSector(unsigned char *buffer, uint32_t lba) {
+static int _stdio_write_sectors(fat_dev_t *dev, unsigned char *buffer, uint32_t lba, uint32_t count) {
+    FILE *cf_file = dev->priv;
+
     printf("write to %08x\n", lba * 512);
-    int ret = fseek(cf_file, lba * 512, SEEK_SET);
+    int ret = fseeko(cf_file, (off_t)lba * 512, SEEK_SET);
     if (ret < 0)
         goto error;
 
-    size_t count = fwrite(buffer, 512, 1, cf_file);
-    if (count != 1)
+    size_t written = fwrite(buffer, 512, count, cf_file);
+    if (written != count)
         goto error;
 
     fflush(cf_file);
 
-    return;
+    return 0;
 
 error:
     abort();
 }
 
+static int _stdio_geometry(fat_dev_t *dev, uint32_t *total_sectors) {
+    struct stat st;
+
+    // size of anything but an image is unknown
+    if (fstat(fileno((FILE *)dev->priv), &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    *total_sectors = st.st_size / 512;
+    return 0;
+}
+
+static void _stdio_close(fat_dev_t *dev) {
+    fclose(dev->priv);
+    free(dev);
+}
+
 /**
- * Open a FAT disk image.
+ * Open a FAT disk image using stdio.
  */
-void fat_disk_open(char *filename) {
+fat_dev_t *fat_stdio_open(char *filename) {
+    fat_dev_t *dev;
+    FILE *cf_file;
+
     cf_file = fopen(filename, "r+");
     if (cf_file == NULL)
         err(1, "Couldn't open %s for reading", filename);
+
+    dev = calloc(1, sizeof(fat_dev_t));
+    if (dev == NULL)
+        err(1, "Couldn't allocate device");
+
+    dev->read_sectors = _stdio_read_sectors;
+    dev->write_sectors = _stdio_write_sectors;
+    dev->geometry = _stdio_geometry;
+    dev->close = _stdio_close;
+    dev->priv = cf_file;
+
+    return dev;
+}
+
+/****************************
+ * pread/pwrite CF functions *
+ ***************************/
+
+typedef struct _pread_dev_t {
+    fat_dev_t dev;
+    int fd;
+} pread_dev_t;
+
+static int _pread_read_sectors(fat_dev_t *dev, unsigned char *buffer, uint32_t lba, uint32_t count) {
+    int fd = ((pread_dev_t *)dev)->fd;
+    size_t left = (size_t)count * 512;
+    off_t offset = (off_t)lba * 512;
+    ssize_t ret;
+
+    while (left > 0) {
+        ret = pread(fd, buffer, left, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        // error or short image
+        if (ret <= 0)
+            return -1;
+
+        buffer += ret;
+        offset += ret;
+        left -= ret;
+    }
+
+    return 0;
+}
+
+static int _pread_write_sectors(fat_dev_t *dev, unsigned char *buffer, uint32_t lba, uint32_t count) {
+    int fd = ((pread_dev_t *)dev)->fd;
+    size_t left = (size_t)count * 512;
+    off_t offset = (off_t)lba * 512;
+    ssize_t ret;
+
+    while (left > 0) {
+        ret = pwrite(fd, buffer, left, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0)
+            return -1;
+
+        buffer += ret;
+        offset += ret;
+        left -= ret;
+    }
+
+    return 0;
+}
+
+// writes only hit the disk for sure when fat_sync() is called
+static int _pread_flush(fat_dev_t *dev) {
+    return fdatasync(((pread_dev_t *)dev)->fd);
+}
+
+// punch a hole in the image so freed clusters don't take up space
+static int _pread_discard(fat_dev_t *dev, uint32_t lba, uint32_t count) {
+    return fallocate(((pread_dev_t *)dev)->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            (off_t)lba * 512, (off_t)count * 512);
+}
+
+// get the kernel reading ahead
+static void _pread_prefetch(fat_dev_t *dev, uint32_t lba, uint32_t count) {
+    posix_fadvise(((pread_dev_t *)dev)->fd, (off_t)lba * 512, (off_t)count * 512, POSIX_FADV_WILLNEED);
+}
+
+static int _pread_geometry(fat_dev_t *dev, uint32_t *total_sectors) {
+    struct stat st;
+
+    // size of anything but an image is unknown
+    if (fstat(((pread_dev_t *)dev)->fd, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    *total_sectors = st.st_size / 512;
+    return 0;
+}
+
+static void _pread_close(fat_dev_t *dev) {
+    close(((pread_dev_t *)dev)->fd);
+    free(dev);
+}
+
+/**
+ * Open a FAT disk image using positional reads and writes on a raw fd. No
+ * data is flushed until fat_sync() is called.
+ */
+fat_dev_t *fat_pread_open(char *filename) {
+    pread_dev_t *pdev;
+    int fd;
+
+    fd = open(filename, O_RDWR);
+    if (fd < 0)
+        err(1, "Couldn't open %s for reading", filename);
+
+    pdev = calloc(1, sizeof(pread_dev_t));
+    if (pdev == NULL)
+        err(1, "Couldn't allocate device");
+
+    pdev->dev.read_sectors = _pread_read_sectors;
+    pdev->dev.write_sectors = _pread_write_sectors;
+    pdev->dev.flush = _pread_flush;
+    pdev->dev.discard = _pread_discard;
+    pdev->dev.geometry = _pread_geometry;
+    pdev->dev.close = _pread_close;
+    pdev->dev.prefetch = _pread_prefetch;
+    pdev->fd = fd;
+
+    return &pdev->dev;
+}
+
+/***********************
+ * mmap'd CF functions *
+ **********************/
+
+typedef struct _mmap_dev_t {
+    fat_dev_t dev;
+    int fd;
+    unsigned char *map;
+    uint32_t total_sectors;
+} mmap_dev_t;
+
+static unsigned char *_mmap_map_sectors(fat_dev_t *dev, uint32_t lba, uint32_t count) {
+    mmap_dev_t *mdev = (mmap_dev_t *)dev;
+
+    if (lba >= mdev->total_sectors || count > mdev->total_sectors - lba)
+        return NULL;
+
+    return mdev->map + (size_t)lba * 512;
+}
+
+static int _mmap_read_sectors(fat_dev_t *dev, unsigned char *buffer, uint32_t lba, uint32_t count) {
+    unsigned char *src = _mmap_map_sectors(dev, lba, count);
+    if (src == NULL)
+        return -1;
+
+    if (src != buffer)
+        memcpy(buffer, src, (size_t)count * 512);
+
+    return 0;
+}
+
+static int _mmap_write_sectors(fat_dev_t *dev, unsigned char *buffer, uint32_t lba, uint32_t count) {
+    unsigned char *dest = _mmap_map_sectors(dev, lba, count);
+    if (dest == NULL)
+        return -1;
+
+    // buffer may have come from map_sectors, in which case it's already there
+    if (dest != buffer)
+        memcpy(dest, buffer, (size_t)count * 512);
+
+    return 0;
+}
+
+static int _mmap_flush(fat_dev_t *dev) {
+    mmap_dev_t *mdev = (mmap_dev_t *)dev;
+    return msync(mdev->map, (size_t)mdev->total_sectors * 512, MS_SYNC);
+}
+
+static int _mmap_discard(fat_dev_t *dev, uint32_t lba, uint32_t count) {
+    return fallocate(((mmap_dev_t *)dev)->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            (off_t)lba * 512, (off_t)count * 512);
+}
+
+// fault the pages in ahead of time
+static void _mmap_prefetch(fat_dev_t *dev, uint32_t lba, uint32_t count) {
+    mmap_dev_t *mdev = (mmap_dev_t *)dev;
+    uintptr_t start, end;
+
+    if (lba >= mdev->total_sectors)
+        return;
+    if (count > mdev->total_sectors - lba)
+        count = mdev->total_sectors - lba;
+
+    // madvise wants page-aligned addresses
+    start = (uintptr_t)(mdev->map + (size_t)lba * 512) & ~(uintptr_t)4095;
+    end = (uintptr_t)(mdev->map + ((size_t)lba + count) * 512);
+    madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+static int _mmap_geometry(fat_dev_t *dev, uint32_t *total_sectors) {
+    *total_sectors = ((mmap_dev_t *)dev)->total_sectors;
+    return 0;
+}
+
+static void _mmap_close(fat_dev_t *dev) {
+    mmap_dev_t *mdev = (mmap_dev_t *)dev;
+
+    munmap(mdev->map, (size_t)mdev->total_sectors * 512);
+    close(mdev->fd);
+    free(mdev);
+}
+
+/**
+ * Open a FAT disk image by mapping the whole thing into memory. Sectors are
+ * handed out as pointers into the mapping, so nothing is copied on the way
+ * in or out. No data is flushed until fat_sync() is called.
+ *
+ * Anything but a regular file, such as a card's block device, has no size
+ * to map and is opened with the pread backend instead. So is an image that
+ * can't be mapped.
+ */
+fat_dev_t *fat_mmap_open(char *filename) {
+    mmap_dev_t *mdev;
+    struct stat st;
+    int fd;
+
+    fd = open(filename, O_RDWR);
+    if (fd < 0)
+        err(1, "Couldn't open %s for reading", filename);
+
+    if (fstat(fd, &st) < 0)
+        err(1, "Couldn't stat %s", filename);
+
+    if (!S_ISREG(st.st_mode) || st.st_size < 512) {
+        close(fd);
+        return fat_pread_open(filename);
+    }
+
+    mdev = calloc(1, sizeof(mmap_dev_t));
+    if (mdev == NULL)
+        err(1, "Couldn't allocate device");
+
+    mdev->total_sectors = st.st_size / 512;
+    mdev->map = mmap(NULL, (size_t)mdev->total_sectors * 512, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mdev->map == MAP_FAILED) {
+        free(mdev);
+        close(fd);
+        return fat_pread_open(filename);
+    }
+
+    mdev->dev.read_sectors = _mmap_read_sectors;
+    mdev->dev.write_sectors = _mmap_write_sectors;
+    mdev->dev.flush = _mmap_flush;
+    mdev->dev.discard = _mmap_discard;
+    mdev->dev.geometry = _mmap_geometry;
+    mdev->dev.close = _mmap_close;
+    mdev->dev.map_sectors = _mmap_map_sectors;
+    mdev->dev.prefetch = _mmap_prefetch;
+    mdev->fd = fd;
+
+    return &mdev->dev;
+}
+
+// backends selectable by name through FAT64_DISK, first one is the default
+static const struct {
+    const char *name;
+    fat_dev_t *(*open)(char *filename);
+} backends[] = {
+    { "mmap", fat_mmap_open },
+    { "pread", fat_pread_open },
+    { "uring", fat_uring_open },
+    { "stdio", fat_stdio_open },
+};
+
+/**
+ * Open a FAT disk image with the default backend. Set the FAT64_DISK
+ * environment variable to the name of a backend to pick another one.
+ */
+fat_dev_t *fat_disk_open(char *filename) {
+    const char *name = getenv("FAT64_DISK");
+    int i;
+
+    if (name == NULL || *name == '\0')
+        return backends[0].open(filename);
+
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i)
+        if (strcmp(name, backends[i].name) == 0)
+            return backends[i].open(filename);
+
+    errx(1, "Unknown disk backend %s", name);
 }
 
 #else
@@ -74,6 +518,10 @@ void fat_disk_open(char *filename) {
 
 #include <libdragon.h>
 
+int             compat_mode = 0; // CF compat mode
+
+static void _ci_read_sector(unsigned char *buffer, uint32_t lba);
+static void _ci_write_sector(unsigned char *buffer, uint32_t lba);
 
 /* Wait for CI status to be 0.
  * Run before and after each command. */
@@ -113,11 +561,12 @@ void cfSectorsToRam(uint32_t ramaddr, uint32_t lba, int sectors)
     ci_status_wait();
 }
 
-int cfOptimizeCycleTime()
+int cfOptimizeCycleTime(unsigned char *first_sector)
 {
+    unsigned char buf[512];
     int cycletime = 40;
 
-    // first sector MUST already be loaded into buffer
+    // first sector MUST already be loaded into first_sector
 
     // the algorithm is as follow:
     // first the cycletime is high, for slow access.
@@ -126,9 +575,9 @@ int cfOptimizeCycleTime()
 
     while(1)
     {
-        cfReadSector(fat_buffer, 0);
+        _ci_read_sector(buf, 0);
 
-        if(memcmp(fat_buffer, buffer, 512) != 0)
+        if(memcmp(buf, first_sector, 512) != 0)
         {
             // newly read buffer differs from original! must be corrupted, slow back down
             cycletime += 5;
@@ -207,7 +656,7 @@ static void _invalidate(volatile void * addr, unsigned long length)
     cache_op(0x1); // a little bird told me
 }
  
-void cfReadSector(unsigned char *buffer, uint32_t lba)
+static void _ci_read_sector(unsigned char *buffer, uint32_t lba)
 {
     ci_status_wait();
 
@@ -227,7 +676,7 @@ void cfReadSector(unsigned char *buffer, uint32_t lba)
     dma_read((void *)((uint32_t)buffer & 0x1fffffff), CI_BUFFER, 512);
 }
 
-void cfWriteSector(unsigned char *buffer, uint32_t lba) {
+static void _ci_write_sector(unsigned char *buffer, uint32_t lba) {
     ci_status_wait();
 
     io_write(CI_LBA, lba);
@@ -241,6 +690,52 @@ void cfWriteSector(unsigned char *buffer, uint32_t lba) {
     ci_status_wait();
 }
 
+static int _ci_read_sectors(fat_dev_t *dev, unsigned char *buffer, uint32_t lba, uint32_t count) {
+    uint32_t i;
+
+    for (i = 0; i < count; ++i)
+        _ci_read_sector(buffer + i * 512, lba + i);
+
+    return 0;
+}
+
+static int _ci_write_sectors(fat_dev_t *dev, unsigned char *buffer, uint32_t lba, uint32_t count) {
+    uint32_t i;
+
+    for (i = 0; i < count; ++i)
+        _ci_write_sector(buffer + i * 512, lba + i);
+
+    return 0;
+}
+
+static fat_dev_t ci_dev = {
+    .read_sectors = _ci_read_sectors,
+    .write_sectors = _ci_write_sectors,
+};
+
+/**
+ * Get the 64drive CF/SD device. Speeds up the bus as much as the card allows
+ * before handing it out.
+ */
+fat_dev_t *fat_ci_open(void) {
+    unsigned char first_sector[512];
+
+    _ci_read_sector(first_sector, 0);
+
+    // only bother if there's something that looks like an MBR/VBR
+    if (first_sector[0x1fe] == 0x55 && first_sector[0x1ff] == 0xaa) {
+        // now speed things up!
+        if(compat_mode)
+        {
+            cfSetCycleTime(30);
+        }else{
+            cfOptimizeCycleTime(first_sector);
+        }
+    }
+
+    return &ci_dev;
+}
+
 // copy N64 RDRAM into 64drive EEPROM emulator
 void ciWriteEEPROMBuffer(unsigned char *buf, int start, int size)
 {
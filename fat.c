@@ -1,5 +1,32 @@
+#include <stdlib.h>
+
 #include "common.h"
 
+/*
+ * Whole FAT table. When enabled, the first copy of the FAT lives in memory,
+ * paged in FAT_TABLE_CHUNK sectors at a time the first time it's touched, and
+ * FAT lookups never leave memory. Dirty sectors are tracked in a bitmap and
+ * written to every copy of the FAT on flush.
+ */
+#define FAT_TABLE_CHUNK 64
+
+static uint32_t *fat_table = NULL;
+static uint32_t *fat_table_dirty = NULL;    // bit per sector
+static uint32_t *fat_table_loaded = NULL;   // bit per chunk
+static uint32_t fat_table_dirty_count = 0;
+
+/*
+ * Free cluster bitmap, one bit per FAT entry, set if the cluster is free.
+ * Built by scanning the FAT at mount and kept current by fat_set_fat, so
+ * finding a free cluster only looks at one word per 32 clusters.
+ */
+static uint32_t *free_map = NULL;
+
+#define BIT_WORDS(n) (((n) + 31) / 32)
+#define BIT_TEST(map, n) ((map)[(n) / 32] & (1u << ((n) % 32)))
+#define BIT_SET(map, n) ((map)[(n) / 32] |= 1u << ((n) % 32))
+#define BIT_CLEAR(map, n) ((map)[(n) / 32] &= ~(1u << ((n) % 32)))
+
 /**
  * Get the relative sector # and offset into the sector for a given cluster.
  */
@@ -18,71 +45,241 @@ static uint32_t _fat_absolute_sector(uint32_t relative_sector, int fat_num) {
     return fat_fs.begin_sector + (fat_num * fat_fs.sect_per_fat) + relative_sector;
 }
 
-// flush changes to the fat
-void fat_flush_fat(void) {
-    uint32_t sector, i;
-    unsigned char fs_info[512];
-    uint32_t old_free;
-
-    if (fat_buffer_dirty) {
-        // write the dirty sector to each copy of the FAT
-        for (i = 0; i < fat_fs.num_fats; ++i) {
-            sector = _fat_absolute_sector(fat_buffer_sector, i);
-            cfWriteSector(fat_buffer, sector);
+/**
+ * Allocate the FAT table. Nothing is read until it's used.
+ *
+ * Returns 0 on success, -1 if out of memory (FAT lookups will go through the
+ * sector cache).
+ */
+int fat_table_init(void) {
+    uint32_t chunks = (fat_fs.sect_per_fat + FAT_TABLE_CHUNK - 1) / FAT_TABLE_CHUNK;
+
+    fat_table_free();
+
+    fat_table = malloc((size_t)fat_fs.sect_per_fat * 512);
+    fat_table_dirty = calloc(BIT_WORDS(fat_fs.sect_per_fat), sizeof(uint32_t));
+    fat_table_loaded = calloc(BIT_WORDS(chunks), sizeof(uint32_t));
+    if (fat_table == NULL || fat_table_dirty == NULL || fat_table_loaded == NULL) {
+        fat_table_free();
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Release the FAT table. Does NOT write back dirty sectors.
+ */
+void fat_table_free(void) {
+    free(fat_table);
+    free(fat_table_dirty);
+    free(fat_table_loaded);
+    fat_table = fat_table_dirty = fat_table_loaded = NULL;
+    fat_table_dirty_count = 0;
+}
+
+/**
+ * Write the dirty sectors of the FAT table to every copy of the FAT, one
+ * request per run of dirty sectors.
+ *
+ * Returns 0 on success, -1 if any write failed.
+ */
+static int _fat_table_flush(void) {
+    uint32_t first, count, i;
+    int ret = 0;
+
+    for (first = 0; first < fat_fs.sect_per_fat && fat_table_dirty_count > 0; first += count) {
+        // skip a whole word of clean sectors at a time
+        if (fat_table_dirty[first / 32] == 0) {
+            count = 32 - first % 32;
+            continue;
         }
 
-        fat_buffer_dirty = 0;
+        if (!BIT_TEST(fat_table_dirty, first)) {
+            count = 1;
+            continue;
+        }
+
+        for (count = 0; first + count < fat_fs.sect_per_fat && BIT_TEST(fat_table_dirty, first + count); ++count)
+            BIT_CLEAR(fat_table_dirty, first + count);
+
+        for (i = 0; i < fat_fs.num_fats; ++i)
+            if (cfWriteSectors((unsigned char *)fat_table + first * 512,
+                    _fat_absolute_sector(first, i), count) != 0)
+                ret = -1;
+
+        fat_table_dirty_count -= count;
     }
 
-    // 
-    // Write free cluster count
-    //
-    cfReadSector(fs_info, fat_fs.info_sector);
-    old_free = intEndian(&fs_info[0x1e8]);
-    if (old_free != fat_fs.free_clusters) {
-        writeInt(&fs_info[0x1e8], fat_fs.free_clusters);
-        cfWriteSector(fs_info, fat_fs.info_sector);
+    return ret;
+}
+
+/**
+ * Get a pointer to the FAT entry for a cluster in the FAT table, paging in
+ * its chunk if this is the first time it's been used.
+ */
+static unsigned char *_fat_table_entry(uint32_t cluster) {
+    uint32_t chunk = cluster / (FAT_TABLE_CHUNK * 128);
+    uint32_t first, count;
+
+    if (!BIT_TEST(fat_table_loaded, chunk)) {
+        first = chunk * FAT_TABLE_CHUNK;
+        count = fat_fs.sect_per_fat - first;
+        if (count > FAT_TABLE_CHUNK)
+            count = FAT_TABLE_CHUNK;
+
+        cfReadSectors((unsigned char *)fat_table + first * 512, _fat_absolute_sector(first, 0), count);
+        BIT_SET(fat_table_loaded, chunk);
+
+        // chains mostly run forwards, so get the next chunk on its way
+        if (first + count < fat_fs.sect_per_fat)
+            cfPrefetch(_fat_absolute_sector(first + count, 0), FAT_TABLE_CHUNK);
     }
+
+    return (unsigned char *)&fat_table[cluster];
+}
+
+/**
+ * Build the free cluster bitmap by scanning the whole FAT. Recounts
+ * fat_fs.free_clusters while it's at it.
+ *
+ * Returns 0 on success, -1 if out of memory (allocation will scan the FAT).
+ */
+int fat_free_map_init(void) {
+    uint32_t num_entries = fat_fs.total_clusters + 2;
+    uint32_t cluster, free_clusters = 0;
+
+    fat_free_map_free();
+
+    free_map = calloc(BIT_WORDS(num_entries), sizeof(uint32_t));
+    if (free_map == NULL)
+        return -1;
+
+    // first two entries are reserved
+    for (cluster = 2; cluster < num_entries; ++cluster)
+        if (fat_get_fat(cluster) == 0) {
+            BIT_SET(free_map, cluster);
+            ++free_clusters;
+        }
+
+    fat_fs.free_clusters = free_clusters;
+
+    return 0;
+}
+
+/**
+ * Release the free cluster bitmap.
+ */
+void fat_free_map_free(void) {
+    free(free_map);
+    free_map = NULL;
+}
+
+// flush changes to the fat
+//
+// returns 0 on success, -1 on I/O error
+int fat_flush_fat(void) {
+    int ret = 0;
+
+    if (fat_table != NULL && _fat_table_flush() != 0)
+        ret = -1;
+
+    // the cache writes each sector to every copy of the FAT
+    if (fat_cache_flush(FAT_CACHE_FAT) != 0)
+        ret = -1;
+
+    return ret;
+}
+
+/**
+ * Write the free cluster count and next free hint to FSInfo, if they've
+ * changed since it was last written. Only fat_sync calls this, the rest of
+ * the sector is kept from when it was read so it isn't read again.
+ *
+ * Returns 0 on success, -1 on I/O error.
+ */
+int fat_flush_fsinfo(void) {
+    unsigned char *fs_info = fat_fs.info.sector;
+
+    if (!fat_fs.info.valid)
+        return 0;
+
+    if (fat_fs.info.free_count == fat_fs.free_clusters &&
+            fat_fs.info.next_free == fat_fs.next_free)
+        return 0;
+
+    writeInt(&fs_info[0x1e8], fat_fs.free_clusters);
+    writeInt(&fs_info[0x1ec], fat_fs.next_free);
+    if (cfWriteSector(fs_info, fat_fs.info_sector) != 0)
+        return -1;
+
+    fat_fs.info.free_count = fat_fs.free_clusters;
+    fat_fs.info.next_free = fat_fs.next_free;
+
+    return 0;
 }
 
 /**
- * Load the sector for a FAT cluster, return offset into sector.
+ * Get a pointer to the FAT entry for a cluster in the sector cache. Also
+ * returns the absolute sector it lives in.
  */
-uint32_t _fat_load_fat(uint32_t cluster) {
+static unsigned char *_fat_load_fat(uint32_t cluster, uint32_t *sector) {
     uint32_t relative_sector, offset;
 
     // get the sector of the FAT and offset into the sector
     fat_sector_offset(cluster, &relative_sector, &offset);
 
-    // only read sector if it has changed! saves time
-    if (relative_sector != fat_buffer_sector) {
-        // flush pending writes
-        fat_flush_fat();
-
-        // read the sector
-        cfReadSector(fat_buffer, _fat_absolute_sector(relative_sector, 0));
-        fat_buffer_sector = relative_sector;
-    }
-
-    return offset;
+    *sector = _fat_absolute_sector(relative_sector, 0);
+    return fat_cache_get(FAT_CACHE_FAT, *sector) + offset;
 }
 
 /**
- * Get the FAT entry for a given cluster.
+ * Get the FAT entry for a given cluster. A cluster past the end of the FAT,
+ * which only a damaged chain leads to, reads as a bad cluster so chain walks
+ * stop there.
  */
 uint32_t fat_get_fat(uint32_t cluster) {
-    uint32_t offset = _fat_load_fat(cluster);
-    return intEndian(&fat_buffer[offset]);
+    uint32_t sector;
+
+    if (cluster >= fat_fs.total_clusters + 2)
+        return 0x0ffffff7;
+
+    if (fat_table != NULL)
+        return intEndian(_fat_table_entry(cluster));
+
+    return intEndian(_fat_load_fat(cluster, &sector));
 }
 
 /**
- * Set the FAT entry for a given cluster.
+ * Set the FAT entry for a given cluster. Clusters past the end of the FAT
+ * are ignored.
  */
 void fat_set_fat(uint32_t cluster, uint32_t value) {
-    uint32_t offset = _fat_load_fat(cluster);
-    writeInt(&fat_buffer[offset], value);
+    uint32_t sector;
+
+    if (cluster >= fat_fs.total_clusters + 2)
+        return;
+
+    if (free_map != NULL && cluster >= 2) {
+        if (value == 0)
+            BIT_SET(free_map, cluster);
+        else
+            BIT_CLEAR(free_map, cluster);
+    }
 
-    fat_buffer_dirty = 1;
+    if (fat_table != NULL) {
+        writeInt(_fat_table_entry(cluster), value);
+
+        sector = cluster / 128;
+        if (!BIT_TEST(fat_table_dirty, sector)) {
+            BIT_SET(fat_table_dirty, sector);
+            ++fat_table_dirty_count;
+        }
+        return;
+    }
+
+    writeInt(_fat_load_fat(cluster, &sector), value);
+    fat_cache_dirty(FAT_CACHE_FAT, sector);
 }
 
 /**
@@ -95,6 +292,29 @@ void fat_set_fat(uint32_t cluster, uint32_t value) {
 static int _fat_find_free_entry(int start, uint32_t *new_entry) {
     uint32_t entry = 1;
     uint32_t num_entries = fat_fs.total_clusters + 2; // 2 unused entries at the start of the FAT
+    uint32_t words, word, bits, i;
+
+    if (start < 0 || (uint32_t)start >= num_entries)
+        start = 0;
+
+    // search the bitmap a word at a time, wrapping around to the start
+    if (free_map != NULL) {
+        words = BIT_WORDS(num_entries);
+        word = start / 32;
+        bits = free_map[word] & (~0u << (start % 32));
+
+        // one extra word to catch bits below start in the first word
+        for (i = 0; i <= words; ++i) {
+            if (bits != 0) {
+                *new_entry = word * 32 + __builtin_ctz(bits);
+                return FAT_SUCCESS;
+            }
+            word = (word + 1) % words;
+            bits = free_map[word];
+        }
+
+        return FAT_NOSPACE;
+    }
 
     if (start > 0)
         entry = start;
@@ -115,12 +335,251 @@ static int _fat_find_free_entry(int start, uint32_t *new_entry) {
     return FAT_SUCCESS;
 }
 
+/**
+ * Find the first cluster at or after cluster (and before end) that is free,
+ * or used if want_free is 0. Returns end if there isn't one.
+ */
+static uint32_t _fat_scan(uint32_t cluster, uint32_t end, int want_free) {
+    uint32_t bits;
+
+    if (free_map == NULL) {
+        while (cluster < end && (fat_get_fat(cluster) == 0) != want_free)
+            ++cluster;
+        return cluster;
+    }
+
+    // a word at a time, skipping words that are all used or all free
+    while (cluster < end) {
+        bits = free_map[cluster / 32];
+        if (!want_free)
+            bits = ~bits;
+        bits &= ~0u << (cluster % 32);
+
+        if (bits != 0) {
+            cluster = cluster - cluster % 32 + __builtin_ctz(bits);
+            return cluster < end ? cluster : end;
+        }
+
+        cluster = cluster - cluster % 32 + 32;
+    }
+
+    return end;
+}
+
+/**
+ * Find free clusters for want more clusters of a file, looking from the
+ * cluster after the end of the file first. If the run there isn't long
+ * enough, this takes the smallest run that is, else the longest run there
+ * is.
+ *
+ * With first set, the first free run found is taken whatever its length.
+ * Without the free bitmap that saves reading the rest of the FAT, which
+ * would be done again for every piece of a fragmented allocation.
+ *
+ * Returns:
+ *  FAT_SUCCESS with the run in start and len, len <= want
+ *  FAT_NOSPACE if there are no free clusters
+ */
+static int _fat_find_free_run(uint32_t from, uint32_t want, int first, uint32_t *start, uint32_t *len) {
+    uint32_t num_entries = fat_fs.total_clusters + 2;
+    uint32_t best_start = 0, best_len = 0, big_start = 0, big_len = 0;
+    uint32_t cluster, end, run, pass;
+
+    if (from < 2 || from >= num_entries)
+        from = 2;
+
+    // from the start point to the end, then wrap around to the start point
+    for (pass = 0; pass < 2; ++pass) {
+        cluster = pass == 0 ? from : 2;
+        end = pass == 0 ? num_entries : from;
+
+        while ((cluster = _fat_scan(cluster, end, 1)) < end) {
+            // without the bitmap the first run that's long enough will do,
+            // so don't read any further than that
+            if (free_map == NULL && end - cluster > want)
+                run = _fat_scan(cluster, cluster + want, 0) - cluster;
+            else
+                run = _fat_scan(cluster, end, 0) - cluster;
+
+            // right where the file ends, or a perfect fit: can't do better
+            if (run >= want && (cluster == from || run == want || free_map == NULL)) {
+                *start = cluster;
+                *len = want;
+                return FAT_SUCCESS;
+            }
+
+            if (first) {
+                *start = cluster;
+                *len = run;
+                return FAT_SUCCESS;
+            }
+
+            if (run >= want && (best_len == 0 || run < best_len)) {
+                best_start = cluster;
+                best_len = run;
+            }
+
+            if (run > big_len) {
+                big_start = cluster;
+                big_len = run;
+            }
+
+            cluster += run;
+        }
+    }
+
+    if (best_len != 0) {
+        *start = best_start;
+        *len = want;
+        return FAT_SUCCESS;
+    }
+
+    if (big_len == 0)
+        return FAT_NOSPACE;
+
+    *start = big_start;
+    *len = big_len;
+    return FAT_SUCCESS;
+}
+
+/**
+ * Find a single run of count free clusters, without allocating it.
+ *
+ * Returns:
+ *  FAT_SUCCESS with the first cluster of the run in start
+ *  FAT_NOSPACE if there is no run that long
+ */
+int fat_find_contiguous(uint32_t count, uint32_t *start) {
+    uint32_t len;
+
+    if (count == 0 || _fat_find_free_run(2, count, 0, start, &len) != FAT_SUCCESS || len < count)
+        return FAT_NOSPACE;
+
+    return FAT_SUCCESS;
+}
+
+/**
+ * Allocate count clusters after the last cluster of a file, in as few runs of
+ * consecutive clusters as the free space allows, and link them into the
+ * chain. Sets the end of file marker.
+ *
+ * If last_cluster is 0 the clusters start a new chain, its first cluster is
+ * returned in first_cluster.
+ *
+ * Returns:
+ *  FAT_SUCCESS on success
+ *  FAT_NOSPACE when the FS doesn't have enough free clusters
+ *  FAT_INCONSISTENT when the fs needs to be checked
+ */
+int fat_allocate_clusters(uint32_t last_cluster, uint32_t count, uint32_t *first_cluster) {
+    uint32_t from, start, len, i;
+    int ret;
+
+    if (count > fat_fs.free_clusters)
+        return FAT_NOSPACE;
+
+    *first_cluster = 0;
+
+    while (count > 0) {
+        // carry on from the end of the file, new files start at the hint
+        from = last_cluster != 0 ? last_cluster + 1 : fat_fs.next_free;
+
+        // without the bitmap, searching for a longer run means reading the
+        // whole FAT, so link whatever is free first
+        ret = _fat_find_free_run(from, count, free_map == NULL, &start, &len);
+
+        // the free cluster count says they're there, so the FS must be
+        // inconsistent
+        if (ret == FAT_NOSPACE)
+            return FAT_INCONSISTENT;
+
+        // link the whole run in one pass over the FAT
+        for (i = 0; i < len; ++i) {
+            if (last_cluster != 0)
+                fat_set_fat(last_cluster, start + i);
+            else
+                *first_cluster = start;
+            last_cluster = start + i;
+        }
+        fat_set_fat(last_cluster, 0x0ffffff8);
+
+        fat_fs.free_clusters -= len;
+        count -= len;
+
+        fat_fs.next_free = last_cluster + 1;
+        if (fat_fs.next_free >= fat_fs.total_clusters + 2)
+            fat_fs.next_free = 2;
+    }
+
+    return FAT_SUCCESS;
+}
+
+// clusters collected per pass when freeing a chain
+#ifdef LINUX
+#define FREE_BATCH 4096
+#else
+#define FREE_BATCH 128
+#endif
+
+static int _fat_cmp_cluster(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Free a chain of clusters starting at cluster. The chain is read a batch
+ * at a time and each batch is freed in cluster order, so every FAT sector
+ * is visited once per batch rather than once per cluster that lands in it.
+ *
+ * n.b., this won't go into an infinite loop on cyclical chains: a cluster
+ * seen twice in a batch is only freed once, and a chain leading back into
+ * an earlier batch finds a free entry and stops.
+ *
+ * Returns:
+ *  FAT_SUCCESS on success
+ *  FAT_INCONSISTENT if the chain leads past the end of the FAT, everything
+ *      before that point is freed
+ */
+int fat_free_chain(uint32_t cluster) {
+    static uint32_t batch[FREE_BATCH];
+    uint32_t count, i;
+    int ret = FAT_SUCCESS;
+
+    while (cluster >= 2 && cluster < 0x0ffffff7) {
+        // collect the next batch of the chain before freeing any of it
+        for (count = 0; count < FREE_BATCH && cluster >= 2 && cluster < 0x0ffffff7; ++count) {
+            if (cluster >= fat_fs.total_clusters + 2) {
+                ret = FAT_INCONSISTENT;
+                cluster = 0;
+                break;
+            }
+            batch[count] = cluster;
+            cluster = fat_get_fat(cluster);
+        }
+
+        qsort(batch, count, sizeof(uint32_t), _fat_cmp_cluster);
+
+        for (i = 0; i < count; ++i) {
+            if (i > 0 && batch[i] == batch[i - 1])
+                continue;
+            fat_set_fat(batch[i], 0);
+            ++fat_fs.free_clusters;
+        }
+    }
+
+    return ret;
+}
+
 /**
  * Allocate a new cluster after the last cluster. Sets the end of file marker
  * in the FAT as a bonus.
  * 
  * If last_cluster is 0, it assumes this is the first cluster in the file and
  * WILL NOT set the FAT entry on cluster 0.
+ *
+ * The search starts right after last_cluster so files stay contiguous. New
+ * files start at the next free hint, which moves past every cluster handed
+ * out and goes back to FSInfo on sync.
  * 
  * Returns:
  *  FAT_SUCCESS on success, new cluster in new_cluster
@@ -129,12 +588,16 @@ static int _fat_find_free_entry(int start, uint32_t *new_entry) {
  */
 int fat_allocate_cluster(uint32_t last_cluster, uint32_t *new_cluster) {
     int ret;
-    uint32_t new_last;
+    uint32_t new_last, start = last_cluster;
 
     if (fat_fs.free_clusters == 0)
         return FAT_NOSPACE;
 
-    ret = _fat_find_free_entry(last_cluster, &new_last);
+    // ignore the hint if it's unknown (0xffffffff) or bogus
+    if (start == 0 && fat_fs.next_free >= 2 && fat_fs.next_free < fat_fs.total_clusters + 2)
+        start = fat_fs.next_free;
+
+    ret = _fat_find_free_entry(start, &new_last);
 
     // according to the free cluster count, we should be able to find a free
     // cluster. since _fat_find_free_entry couldn't, this means the FS must be
@@ -149,6 +612,10 @@ int fat_allocate_cluster(uint32_t last_cluster, uint32_t *new_cluster) {
     fat_set_fat(new_last, 0x0ffffff8);
     --fat_fs.free_clusters;
 
+    fat_fs.next_free = new_last + 1;
+    if (fat_fs.next_free >= fat_fs.total_clusters + 2)
+        fat_fs.next_free = 2;
+
     *new_cluster = new_last;
     return FAT_SUCCESS;
 }
@@ -16,26 +16,68 @@
  */
 int fat_find_create(const char *filename, fat_dirent *folder, fat_dirent *result_de, int dir, int create) {
     int ret;
+    int rewound = folder->index == 0 && folder->cluster == folder->first_cluster;
+    fat_dirent end;
 
     //
     // Try to find the file in the dir, return it if found
     //
 
-    while ((ret = fat_readdir(folder)) > 0)
-        if (strcasecmp(filename, folder->name) == 0) {
-            // found, return it
-            *result_de = *folder;
+    // only a search from the start of the dir can use the lookup cache and
+    // the dir's name index
+    if (rewound) {
+        ret = fat_dcache_lookup(folder->first_cluster, filename, result_de);
+        if (ret > 0)
             return FAT_SUCCESS;
-        }
+
+        // known not to exist. creating still needs the end of the dir
+        if (ret < 0 && !create)
+            return FAT_NOTFOUND;
+    }
+
+    ret = -1;
+    if (rewound && fat_conf.dir_index == FAT_CONF_ON)
+        ret = fat_dindex_find(folder, filename);
+
+    // no index, do it the slow way
+    if (ret < 0) {
+        while ((ret = fat_readdir(folder)) > 0)
+            if (strcasecmp(filename, folder->name) == 0)
+                break;
+    }
+
+    if (ret > 0) {
+        // found, return it
+        *result_de = *folder;
+        if (rewound)
+            fat_dcache_insert(folder->first_cluster, filename, result_de);
+        return FAT_SUCCESS;
+    }
 
     //
     // File not found. Create a new file
     //
 
-    if (!create)
+    if (!create) {
+        if (rewound && ret == 0)
+            fat_dcache_insert_negative(folder->first_cluster, filename);
         return FAT_NOTFOUND;
+    }
+
+    // the new file goes where the dir ends now
+    end = *folder;
 
-    return fat_dir_create_file(filename, folder, result_de, dir);
+    ret = fat_dir_create_file(filename, folder, result_de, dir);
+    if (ret == FAT_SUCCESS) {
+        fat_dindex_add(&end, result_de);
+
+        // replaces any negative entry for the name. the short name is new
+        // to the dir too
+        fat_dcache_insert(result_de->first_cluster, filename, result_de);
+        fat_dcache_invalidate(result_de->first_cluster, result_de->short_name);
+    }
+
+    return ret;
 }
 
 /**
@@ -43,10 +85,11 @@ int fat_find_create(const char *filename, fat_dirent *folder, fat_dirent *result
  * Returns:
  *  FAT_SUCCESS on success
  *  FAT_NOSPACE if the file system is full
+ *  FAT_IOERROR if writing the FAT or dirent failed
  *  FAT_INCONSISTENT if the file system needs to be checked
  */
 int fat_set_size(fat_dirent *de, uint32_t size) {
-    int ret;
+    int ret, freed = FAT_SUCCESS;
     uint32_t bytes_per_clus = fat_fs.sect_per_clus * 512;
     uint32_t current_clusters, new_clusters;
 
@@ -57,57 +100,52 @@ int fat_set_size(fat_dirent *de, uint32_t size) {
     current_clusters = ceil(1.0 * de->size / bytes_per_clus);
     new_clusters = ceil(1.0 * size / bytes_per_clus);
 
+    // open files have to rebuild their extent maps
+    if (new_clusters != current_clusters)
+        ++fat_chain_gen;
+
+    // cached lookups of this file have the old size
+    fat_dcache_invalidate_dirent(de);
+
     // expand file
     if (new_clusters > current_clusters) {
-        uint32_t count = 0;
+        uint32_t count = 0, first;
         uint32_t current = de->start_cluster;
 
-        // first make sure we have enough clusters
-        if (new_clusters - current_clusters > fat_fs.free_clusters)
-            return FAT_NOSPACE;
-
-        // if the file's empty it will have no clusters, so create the first
-        if (current == 0) {
-            ret = fat_allocate_cluster(0, &current);
-
-            // see comment below about FAT_INCONSISTENT for details
-            if (ret == FAT_NOSPACE)
-                return FAT_INCONSISTENT;
-
-            de->start_cluster = current;
-            ++count;
-        }
-
-        // otherwise skip to last entry
-        else {
+        // find the end of the chain, if the file has one. clusters reserved
+        // by fat_preallocate may already cover the new size
+        if (current != 0) {
             uint32_t prev = current;
-            while ((current = fat_get_fat(current)) < 0x0ffffff8) {
-                uint32_t current_pos;
-
+            ++count;
+            while (count < new_clusters && (current = fat_get_fat(current)) < 0x0ffffff8) {
                 ++count;
                 prev = current;
 
-                // check for cyclical or too large FAT entries
-                current_pos = count * 512 * fat_fs.sect_per_clus;
-                if (current_pos > de->size)
+                // check for cyclical FAT entries, and ones off the end
+                if (count > fat_fs.total_clusters || current >= fat_fs.total_clusters + 2)
                     return FAT_INCONSISTENT;
             }
             current = prev;
-            ++count; // account for terminating sector
         }
 
-        // add new clusters
-        while (count < new_clusters) {
-            ret = fat_allocate_cluster(current, &current);
+        // make sure we have enough clusters
+        if (new_clusters - count > fat_fs.free_clusters)
+            return FAT_NOSPACE;
 
-            // we already made sure there would be enough clusters according
-            // to metadata, so if we can't allocate a cluster then the file
-            // system must be inconsistent
-            if (ret == FAT_NOSPACE)
-                return FAT_INCONSISTENT;
+        // add new clusters, in as few runs as possible
+        ret = count < new_clusters ? fat_allocate_clusters(current, new_clusters - count, &first) : FAT_SUCCESS;
 
-            ++count;
-        }
+        // we already made sure there would be enough clusters according
+        // to metadata, so if we can't allocate a cluster then the file
+        // system must be inconsistent
+        if (ret == FAT_NOSPACE)
+            return FAT_INCONSISTENT;
+        if (ret != FAT_SUCCESS)
+            return ret;
+
+        // a file that was empty starts with the new clusters
+        if (de->start_cluster == 0)
+            de->start_cluster = first;
     }
 
     // remove sectors
@@ -128,17 +166,8 @@ int fat_set_size(fat_dirent *de, uint32_t size) {
         else
             de->start_cluster = 0;
 
-        // zero the rest of the FAT entries
-        // n.b., this won't go into infinite loop on cyclical FAT lists
-        //   assume 2 -> 3 -> 2
-        //   2 gets set to 0, 3 gets set to 0, 2 is loaded again, value is 0
-        //   loop breaks, all good
-        do {
-            uint32_t next = fat_get_fat(current);
-            fat_set_fat(current, 0);
-            current = next;
-            ++fat_fs.free_clusters;
-        } while (current < 0x0ffffff6 && current > 0);
+        // free the rest of the chain
+        freed = fat_free_chain(current);
     }
 
     else // (new_clusters == current_clusters), NOP but still need to update dirent
@@ -150,10 +179,10 @@ int fat_set_size(fat_dirent *de, uint32_t size) {
     // write it back to disk
     _fat_write_dirent(de);
 
-    fat_flush_fat();
-    _fat_flush_dir();
+    if (fat_flush_fat() != 0 || _fat_flush_dir() != 0)
+        return FAT_IOERROR;
 
-    return 0;
+    return freed;
 }
 
 /**
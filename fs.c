@@ -6,23 +6,35 @@
 unsigned char buffer[512];
 char message1[4096];
 
-unsigned char fat_buffer[512];
-uint32_t fat_buffer_sector = -1;
-int fat_buffer_dirty = 0;
-
-uint32_t dir_buffer_sector = 0;
-int dir_buffer_dirty = 0;
-
 uint32_t fs_begin_sector;
 
 fat_fs_t fat_fs;
+fat_config_t fat_conf;
+uint32_t fat_chain_gen = 0;
 
-void fat_sector_offset(uint32_t cluster, uint32_t *fat_sector, uint32_t *fat_offset);
-
-#ifndef LINUX
-int             compat_mode = 0; // CF compat mode
+// defaults for fat_conf
+#ifdef LINUX
+#define DEFAULT_CACHE_FAT_SECTORS   16384
+#define DEFAULT_CACHE_DIR_SECTORS   4096
+#define DEFAULT_CACHE_DATA_SECTORS  4096
+#define DEFAULT_CACHE_WAYS          8
+#define DEFAULT_FAT_TABLE           FAT_CONF_ON
+#define DEFAULT_FREE_BITMAP         FAT_CONF_ON
+#define DEFAULT_DCACHE_ENTRIES      1024
+#define DEFAULT_DIR_INDEX           FAT_CONF_ON
+#else
+#define DEFAULT_CACHE_FAT_SECTORS   8
+#define DEFAULT_CACHE_DIR_SECTORS   4
+#define DEFAULT_CACHE_DATA_SECTORS  4
+#define DEFAULT_CACHE_WAYS          2
+#define DEFAULT_FAT_TABLE           FAT_CONF_OFF
+#define DEFAULT_FREE_BITMAP         FAT_CONF_OFF
+#define DEFAULT_DCACHE_ENTRIES      16
+#define DEFAULT_DIR_INDEX           FAT_CONF_OFF
 #endif
 
+void fat_sector_offset(uint32_t cluster, uint32_t *fat_sector, uint32_t *fat_offset);
+
 // 2-byte number
 unsigned short shortEndian(unsigned char *i)
 {
@@ -73,6 +85,8 @@ char *fat_errstr(int code) {
             return "end of file";
         case FAT_NOTFOUND:
             return "file not found";
+        case FAT_IOERROR:
+            return "I/O error";
         case FAT_INCONSISTENT:
             return "inconsistent file system";
         default:
@@ -82,16 +96,51 @@ char *fat_errstr(int code) {
 }
 
 /**
- * Init the file system.
+ * Set tunables for the next fat_init. Fields left at 0 get the default.
+ */
+void fat_config(const fat_config_t *config) {
+    fat_conf = *config;
+}
+
+/**
+ * Init the file system on a block device.
  *
  * Returns:
  *  0   success
  *  1   failure, with message in message1 (FIXME)
  */
-int fat_init(void) {
+int fat_init(fat_dev_t *dev) {
     char fat_systemid[8];
     uint32_t fat_num_resv_sect;
-    uint32_t total_sectors, data_offset;
+    uint32_t total_sectors, data_offset, dev_sectors;
+
+    fat_dev = dev;
+
+    if (fat_conf.cache_fat_sectors == 0)
+        fat_conf.cache_fat_sectors = DEFAULT_CACHE_FAT_SECTORS;
+    if (fat_conf.cache_dir_sectors == 0)
+        fat_conf.cache_dir_sectors = DEFAULT_CACHE_DIR_SECTORS;
+    if (fat_conf.cache_data_sectors == 0)
+        fat_conf.cache_data_sectors = DEFAULT_CACHE_DATA_SECTORS;
+    if (fat_conf.cache_ways == 0)
+        fat_conf.cache_ways = DEFAULT_CACHE_WAYS;
+    if (fat_conf.fat_table == 0)
+        fat_conf.fat_table = DEFAULT_FAT_TABLE;
+    if (fat_conf.free_bitmap == 0)
+        fat_conf.free_bitmap = DEFAULT_FREE_BITMAP;
+    if (fat_conf.dcache_entries == 0)
+        fat_conf.dcache_entries = DEFAULT_DCACHE_ENTRIES;
+    if (fat_conf.dir_index == 0)
+        fat_conf.dir_index = DEFAULT_DIR_INDEX;
+
+    if (fat_cache_init() != 0) {
+        sprintf(message1, "Out of memory for sector cache.");
+        return 1;
+    }
+
+    // path lookups work without it, just slower
+    fat_dcache_init();
+    fat_dindex_free();
 
     // read first sector
     cfReadSector(buffer, 0);
@@ -102,16 +151,6 @@ int fat_init(void) {
         return 1;
     }
 
-#ifndef LINUX
-    // now speed things up!
-    if(compat_mode)
-    {
-        cfSetCycleTime(30);
-    }else{
-        cfOptimizeCycleTime();
-    }
-#endif
-
     // look for 'FAT'
     if(strncmp((char *)&buffer[82], "FAT", 3) == 0)
     {
@@ -146,13 +185,36 @@ int fat_init(void) {
     fat_fs.clus_begin_sector = fs_begin_sector + data_offset;
 
     total_sectors = intEndian(&buffer[0x20]);
+
+    // make sure the volume actually fits on the device
+    if (dev->geometry != NULL && dev->geometry(dev, &dev_sectors) == 0) {
+        if (fs_begin_sector + total_sectors > dev_sectors) {
+            sprintf(message1, "FAT32 partition larger than device.");
+            return 1;
+        }
+    }
+
     fat_fs.total_clusters = (total_sectors - data_offset) / fat_fs.sect_per_clus;
 
     //
-    // Load free cluster count
+    // Load free cluster count and next free hint, written back on sync
     //
-    cfReadSector(buffer, fs_begin_sector + 1);
-    fat_fs.free_clusters = intEndian(&buffer[0x1e8]);
+    cfReadSector(buffer, fat_fs.info_sector);
+    memcpy(fat_fs.info.sector, buffer, 512);
+    fat_fs.info.valid = intEndian(&buffer[0]) == 0x41615252 && intEndian(&buffer[0x1e4]) == 0x61417272;
+    fat_fs.info.free_count = intEndian(&buffer[0x1e8]);
+    fat_fs.info.next_free = intEndian(&buffer[0x1ec]);
+
+    fat_fs.free_clusters = fat_fs.info.free_count;
+    fat_fs.next_free = fat_fs.info.next_free;
+
+    // not enough memory for the table just means using the sector cache
+    if (fat_conf.fat_table == FAT_CONF_ON)
+        fat_table_init();
+
+    // this also corrects the free cluster count if FSInfo was stale
+    if (fat_conf.free_bitmap == FAT_CONF_ON)
+        fat_free_map_init();
 
     sprintf(message1, "Loaded successfully.");
 
@@ -160,32 +222,55 @@ int fat_init(void) {
 }
 
 /**
- * Get an array of all the sectors a file owns. Returns all sectors of all
- * clusters even if the file does not occupy all the sectors (i.e., a 512 byte
- * file will still return 4 sectors in a 4 sector-per-cluster FS).
+ * Write all pending changes to the device and ask the device to make them
+ * durable. The sizes of files still open for writing are only written by
+ * fat_fsync or fat_close on each of them.
  *
- * Return 0 on succes, -1 on fail
- * Only failure mode is if the size of the sectors array is too small.
+ * Returns:
+ *  FAT_SUCCESS on success
+ *  FAT_IOERROR if a write failed or the device couldn't flush
  */
-int fat_get_sectors(uint32_t start_cluster, uint32_t *sectors, int size) {
-    int i, num = 0;
-    uint32_t cluster, sector;
+int fat_sync(void) {
+    int ret = FAT_SUCCESS;
 
-    cluster = start_cluster;
+    // keep going after a failure, so as much as possible gets out
+    if (_fat_flush_dir() != 0)
+        ret = FAT_IOERROR;
+    if (fat_flush_fat() != 0)
+        ret = FAT_IOERROR;
+    if (fat_cache_flush(FAT_CACHE_DATA) != 0)
+        ret = FAT_IOERROR;
 
-    while (cluster < 0x0ffffff8) {
-        sector = CLUSTER_TO_SECTOR(cluster);
-        for (i = 0; i < fat_fs.sect_per_clus; ++i) {
-            // make sure we have enough space for the sectors
-            if (num >= size)
-                return -1;
+    if (fat_flush_fsinfo() != 0)
+        ret = FAT_IOERROR;
 
-            sectors[num++] = sector + i;
-        }
-        cluster = fat_get_fat(cluster);
-    }
+    if (cfFlush() != 0)
+        ret = FAT_IOERROR;
 
-    return 0;
+    return ret;
+}
+
+/**
+ * Sync the file system, release its memory and close the device.
+ *
+ * Returns:
+ *  FAT_SUCCESS on success
+ *  FAT_IOERROR if the device couldn't flush
+ */
+int fat_unmount(void) {
+    int ret = fat_sync();
+
+    fat_dindex_free();
+    fat_dcache_free();
+    fat_free_map_free();
+    fat_table_free();
+    fat_cache_free();
+
+    if (fat_dev->close != NULL)
+        fat_dev->close(fat_dev);
+    fat_dev = NULL;
+
+    return ret;
 }
 
 /**
@@ -5,6 +5,32 @@
 #include <sys/types.h>
 
 typedef struct _fat_file_t fat_file_t;
+typedef struct _fat_dev_t fat_dev_t;
+
+/*
+ * Block device the file system lives on. Sector numbers and counts are in
+ * 512-byte sectors. Operations return 0 on success and nonzero on failure.
+ * read_sectors and write_sectors are mandatory, the rest MAY be NULL.
+ *
+ * map_sectors returns a pointer straight into the device's memory, or NULL
+ * if the range can't be mapped. Writes through the pointer are writes to the
+ * device.
+ *
+ * prefetch is a hint that a run of sectors will be read soon. The device may
+ * start reading it in the background.
+ */
+struct _fat_dev_t {
+    int (*read_sectors)(fat_dev_t *dev, unsigned char *buf, uint32_t lba, uint32_t count);
+    int (*write_sectors)(fat_dev_t *dev, unsigned char *buf, uint32_t lba, uint32_t count);
+    int (*flush)(fat_dev_t *dev);
+    int (*discard)(fat_dev_t *dev, uint32_t lba, uint32_t count);
+    int (*geometry)(fat_dev_t *dev, uint32_t *total_sectors);
+    void (*close)(fat_dev_t *dev);
+    unsigned char *(*map_sectors)(fat_dev_t *dev, uint32_t lba, uint32_t count);
+    void (*prefetch)(fat_dev_t *dev, uint32_t lba, uint32_t count);
+
+    void *priv; // backend private data
+};
 
 char *fat_errstr(int code);
 
@@ -12,18 +38,93 @@ char *fat_errstr(int code);
 #define FAT_NOSPACE 1
 #define FAT_EOF 2
 #define FAT_NOTFOUND 3
+#define FAT_IOERROR 4
 #define FAT_BADINPUT 128
 #define FAT_INCONSISTENT 256
 
-int fat_init(void);
+/*
+ * Tunables, pass to fat_config() before fat_init(). Anything left at 0 gets
+ * the default for the platform.
+ */
+typedef struct _fat_config_t {
+    // sectors of FAT, directories and file data to keep in the sector cache
+    uint32_t cache_fat_sectors;
+    uint32_t cache_dir_sectors;
+    uint32_t cache_data_sectors;
+
+    // associativity of the sector cache
+    uint32_t cache_ways;
+
+    // keep the whole FAT in memory, paged in as it's used: FAT_CONF_ON or
+    // FAT_CONF_OFF. on by default on Linux
+    int fat_table;
+
+    // scan the FAT at mount and keep a bitmap of free clusters for
+    // allocation: FAT_CONF_ON or FAT_CONF_OFF. on by default on Linux
+    int free_bitmap;
+
+    // number of path lookups to remember, including names that weren't found
+    uint32_t dcache_entries;
+
+    // index the names in directories as they're searched: FAT_CONF_ON or
+    // FAT_CONF_OFF. on by default on Linux
+    int dir_index;
+} fat_config_t;
+
+#define FAT_CONF_ON     1
+#define FAT_CONF_OFF    -1
+
+void fat_config(const fat_config_t *config);
+
+int fat_init(fat_dev_t *dev);
+int fat_sync(void);
+int fat_unmount(void);
+
+void fat_dcache_stats(uint32_t *hits, uint32_t *negative_hits, uint32_t *misses);
+
+// block devices
+#ifdef LINUX
+fat_dev_t *fat_disk_open(char *filename);
+fat_dev_t *fat_stdio_open(char *filename);
+fat_dev_t *fat_pread_open(char *filename);
+fat_dev_t *fat_mmap_open(char *filename);
+fat_dev_t *fat_uring_open(char *filename);
+#else
+fat_dev_t *fat_ci_open(void);
+#endif
 
 int fat_root(fat_file_t *file);
 
+// a run of a file's data that's contiguous on disk, from fat_get_extents
+typedef struct _fat_file_extent_t {
+    uint32_t offset;    // in the file, in bytes
+    uint32_t sector;    // first sector on disk
+    uint32_t count;     // in sectors
+} fat_file_extent_t;
+
+// one buffer for fat_readv and fat_writev
+typedef struct _fat_iovec_t {
+    void *base;
+    uint32_t len;
+} fat_iovec_t;
+
 // file operations
 int fat_open(const char *filename, char *flags, fat_file_t *file);
+int fat_close(fat_file_t *file);
+int fat_fsync(fat_file_t *file);
 int32_t fat_read(fat_file_t *file, unsigned char *buf, int32_t len);
+int32_t fat_write(fat_file_t *file, const unsigned char *buf, int32_t len);
+int32_t fat_pread(fat_file_t *file, unsigned char *buf, int32_t len, off_t offset);
+int32_t fat_pwrite(fat_file_t *file, const unsigned char *buf, int32_t len, off_t offset);
+int32_t fat_readv(fat_file_t *file, const fat_iovec_t *iov, int iovcnt);
+int32_t fat_writev(fat_file_t *file, const fat_iovec_t *iov, int iovcnt);
+int fat_get_extents(fat_file_t *file, uint32_t *offset, fat_file_extent_t *extents, int max);
 int fat_lseek(fat_file_t *file, off_t offset, int whence);
 off_t fat_tell(fat_file_t *file);
+int fat_preallocate(fat_file_t *file, uint32_t size, int flags);
+
+// fat_preallocate flags
+#define FAT_PREALLOC_EXTEND 1
 
 int fat_file_isdir(fat_file_t *file);
 uint32_t fat_file_size(fat_file_t *file);
@@ -111,23 +111,37 @@ static int _fat_open(const char *path, struct fuse_file_info *fi) {
 // if the file is opened multiple times (a la dup/dup2) this is called the last
 // time the file is closed
 static int _fat_release(const char *path, struct fuse_file_info *fi) {
-    free((fat_file_t *)(uintptr_t)fi->fh);
+    fat_file_t *file = (fat_file_t *)(uintptr_t)fi->fh;
+
+    fat_close(file);
+    free(file);
     return 0;
 }
 
 static int _fat_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     fat_file_t *file = (fat_file_t *)(uintptr_t)fi->fh;
+    int32_t ret;
 
-    // seek if we're not at the right position
-    if (offset != file->position) {
-        int ret = fat_lseek(file, offset, SEEK_SET);
-        if (ret != FAT_SUCCESS)
-            return -EIO;
-    }
+    ret = fat_pread(file, (unsigned char *)buf, size, offset);
+    if (ret < 0)
+        return -EIO;
+
+    return ret;
+}
 
-    size = fat_read(file, (unsigned char *)buf, size);
+// write back whatever the file has in memory
+static int _fat_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    fat_file_t *file = (fat_file_t *)(uintptr_t)fi->fh;
+
+    if (fat_fsync(file) != FAT_SUCCESS)
+        return -EIO;
+
+    return 0;
+}
 
-    return size;
+// unmounting, write back everything still in memory
+static void _fat_destroy(void *private_data) {
+    fat_unmount();
 }
 
 static struct fuse_operations fat_oper = {
@@ -136,11 +150,12 @@ static struct fuse_operations fat_oper = {
     .open           = _fat_open,
     .release        = _fat_release,
     .read           = _fat_read,
+    .fsync          = _fat_fsync,
+    .destroy        = _fat_destroy,
 };
 
 int main(int argc, char **argv) {
-    fat_disk_open("fat32.img");
-    int ret = fat_init();
+    int ret = fat_init(fat_disk_open("fat32.img"));
     if (ret != 0) {
         puts(message1);
         abort();
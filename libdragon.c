@@ -154,6 +154,7 @@ static int fat64_close(uint32_t handle)
         return -1; // DFS_EBADHANDLE; // FIXME
     }
 
+    fat_close(file);
     memset(file, 0, sizeof(fat_file_t));
     open_files[handle].open = 0;
 
@@ -335,7 +336,7 @@ static filesystem_t fat64_fs = {
 /* Initialize the filesystem.  */
 int fat64_init(void)
 {
-    int ret = fat_init();
+    int ret = fat_init(fat_ci_open());
 
     if( ret != FAT_SUCCESS )
     {
@@ -348,6 +349,25 @@ int fat64_init(void)
 
     return FAT_SUCCESS;
 }
+
+/* Close any files still open, write everything back to the card and stop
+   serving cf:/.  Call before the card is removed or the console reset. */
+int fat64_unmount(void)
+{
+    int i;
+
+    for( i = 0; i < MAX_OPEN_FILES; i++ )
+    {
+        if( open_files[i].open )
+        {
+            fat64_close( i );
+        }
+    }
+
+    detach_filesystem( "cf:/" );
+
+    return fat_unmount();
+}
 #endif
 
 // debugging
@@ -371,9 +391,7 @@ int main(int argc, char **argv) {
         fat64_dir_findfirst, fat64_dir_findnext,
         __open, __fstat, __lseek, __read, __close);
 
-    fat_disk_open(argv[1]);
-
-    ret = fat_init();
+    ret = fat_init(fat_disk_open(argv[1]));
     if (ret != 0)
         errx(1, "%s", message1);
 
@@ -44,9 +44,32 @@ void test_set_size(void) {
     puts("size 0");
 }
 
+void test_read_past_eof(void) {
+    fat_dirent dir, result;
+    fat_file_t file;
+    unsigned char buf[16];
+
+    fat_root_dirent(&dir);
+    if (fat_find_create("eof.bin", &dir, &result, 0, 1) != 0)
+        abort();
+
+    fat_open_from_dirent(&file, &result);
+    memset(buf, 'x', sizeof(buf));
+    fat_write(&file, buf, sizeof(buf));
+
+    // shrink the file out from under its position
+    fat_set_size(&file.de, 4);
+    printf("read past the end: %d, want 0\n", fat_read(&file, buf, sizeof(buf)));
+    printf("pread past the end: %d, want 0\n", fat_pread(&file, buf, sizeof(buf), 1000));
+
+    fat_close(&file);
+}
+
 int main(int argc, char **argv) {
-    int ret, i;
-    uint32_t sectors[10];
+    int ret, i, n = 0;
+    fat_file_t menu;
+    fat_file_extent_t extents[10];
+    uint32_t extent_offset = 0;
 
     if (argc < 2) {
         printf("Usage: %s <file_system.img>\n", argv[0]);
@@ -55,18 +78,21 @@ int main(int argc, char **argv) {
 
     srand(time(NULL));
 
-    fat_disk_open(argv[1]);
-
-    ret = fat_init();
+    ret = fat_init(fat_disk_open(argv[1]));
     if (ret != 0)
         errx(1, "%s", message1);
 
     // never leave a loaded gun lying around
+    if (fat_unmount() != FAT_SUCCESS)
+        errx(1, "sync failed");
     return 0;
 
     // test_find_create();
     // return 0;
 
+    // test_read_past_eof();
+    // return 0;
+
     /*
     puts("testing set_size");
     test_set_size();
@@ -95,6 +121,7 @@ int main(int argc, char **argv) {
     write(0, buf, sizeof(buf));
     // ret = fat_find_create("menu.bin", &root_folder, &menu_file, 0, 0);
 
+    fat_unmount();
     return 0;
 
     /*
@@ -109,7 +136,9 @@ int main(int argc, char **argv) {
     uint32_t start;
     while ((ret = fat_readdir(&de)) > 0) {
         if (strcmp(de.long_name, "menu.bin") == 0) {
-            fat_get_sectors(de.start_cluster, sectors, 10);
+            fat_open_from_dirent(&menu, &de);
+            n = fat_get_extents(&menu, &extent_offset, extents, 10);
+            fat_close(&menu);
             start = de.start_cluster;
         }
 
@@ -124,9 +153,9 @@ int main(int argc, char **argv) {
     if (ret < 0)
         errx(1, "%s", message1);
  
-    printf("sectors for menu.bin: ");
-    for (i = 0; i < 10; ++i)
-        printf("%d ", sectors[i]);
+    printf("extents for menu.bin:");
+    for (i = 0; i < n; ++i)
+        printf(" %u+%u", extents[i].sector, extents[i].count);
     printf("\n");
 
     uint32_t sector, offset;
@@ -139,5 +168,6 @@ int main(int argc, char **argv) {
     ret = fat_get_sector(start, 211024, &sector, &offset);
     printf("ret %d, sector %d offset %d\n", ret, sector, offset);
 
+    fat_unmount();
     return 0;
 }
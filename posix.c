@@ -9,13 +9,21 @@
 #define MAX_DIRECTORY_DEPTH     16
 #define MAX_FILENAME_LEN        255
 
-// sector read from file
-unsigned char file_buffer[512];
-uint32_t file_buffer_sector = 0;
-
 // helper functions
 static char *get_next_token(char *path, char *token);
-static int _fat_load_file_sector(fat_file_t *file);
+static void _fat_file_init(fat_file_t *file);
+static void _fat_readahead(fat_file_t *file, uint32_t index);
+static int _fat_file_cluster(fat_file_t *file, uint32_t index, uint32_t *cluster, uint32_t *run);
+static int _fat_build_extents(fat_file_t *file);
+static int _fat_add_extents(fat_file_t *file, uint32_t cluster, uint32_t index);
+static int _fat_grow_chain(fat_file_t *file, uint32_t want);
+static int _fat_zero_fill(fat_file_t *file);
+static int _fat_trim_chain(fat_file_t *file);
+static int _fat_write_back(fat_file_t *file, int trim);
+static unsigned char *_fat_sector_data(fat_file_t *file, uint32_t sector);
+static int32_t _fat_read_at(fat_file_t *file, unsigned char *buf, int32_t len, uint32_t pos);
+static int32_t _fat_write_at(fat_file_t *file, const unsigned char *buf, int32_t len, uint32_t pos);
+static int32_t _fat_vector(fat_file_t *file, const fat_iovec_t *iov, int iovcnt, int write);
 
 /**
  * open a file a la fopen, with full path
@@ -74,19 +82,62 @@ int fat_open(const char *filename, char *flags, fat_file_t *file) {
         // now we have the containing dir, so use that in fat_find_create
         ret = fat_find_create(last_slash + 1, &folder_de, &result_de, dir, 1);
         if (ret != FAT_SUCCESS) return ret;
+
+        // ret_type is the containing dir's
+        ret_type = dir ? TYPE_DIR : TYPE_FILE;
     }
 
-    file->de = result_de;
+    fat_open_from_dirent(file, &result_de);
     file->dir = ret_type == TYPE_DIR;
 
-    file->cluster = result_de.start_cluster;
-    file->sector = 0;
-    file->offset = 0;
-    file->position = 0;
-
     return FAT_SUCCESS;
 }
 
+/**
+ * Write back everything fat_write and fat_preallocate left in memory for an
+ * open file, its size included, and ask the device to make it durable. The
+ * file stays open, and keeps any clusters it has reserved. A file with
+ * nothing to write back costs nothing.
+ *
+ * Returns:
+ *  FAT_SUCCESS on success
+ *  FAT_IOERROR if writing something back failed
+ *  FAT_INCONSISTENT if the file system needs to be checked
+ */
+int fat_fsync(fat_file_t *file) {
+    int ret;
+
+    if (!file->dirty && file->zero_from >= file->de.size)
+        return FAT_SUCCESS;
+
+    ret = _fat_write_back(file, 0);
+
+    if (cfFlush() != 0)
+        ret = FAT_IOERROR;
+
+    return ret;
+}
+
+/**
+ * Finish with an open file: zero any space fat_preallocate added to it and
+ * give back the clusters it reserved but the file didn't use, write back
+ * what fat_write left in memory and release its memory. The file can't be
+ * used afterwards without opening it again.
+ *
+ * Returns:
+ *  FAT_SUCCESS on success
+ *  FAT_IOERROR if writing something back failed
+ *  FAT_INCONSISTENT if the file system needs to be checked
+ */
+int fat_close(fat_file_t *file) {
+    int ret = _fat_write_back(file, 1);
+
+    free(file->extents);
+    _fat_file_init(file);
+
+    return ret;
+}
+
 /**
  * Open a file from a dirent. Assumes you've found the file you desire using
  * fat_find_create.
@@ -95,93 +146,150 @@ void fat_open_from_dirent(fat_file_t *file, fat_dirent *de) {
     file->de = *de;
     file->dir = 0; // FIXME ?
 
-    file->cluster = de->start_cluster;
-    file->sector = 0;
-    file->offset = 0;
-    file->position = 0;
+    _fat_file_init(file);
 }
 
 /**
  * Read len bytes out of file into buf.
  *
+ * Whole sectors are read straight into buf, one request per run of
+ * consecutive clusters, only a partial sector at either end is copied out of
+ * the file's own buffer.
+ *
  * Returns the number of bytes read.
  * If return value == 0, file is at EOF.
  *
  * Return of -1 indicates error.
  */
 int32_t fat_read(fat_file_t *file, unsigned char *buf, int32_t len) {
-    uint32_t bytes_read = 0;
-    int ret;
+    int32_t bytes_read = _fat_read_at(file, buf, len, file->position);
 
-    if (len < 0)
-        return -1;
+    // FIXME: fs_error() function
+    if (bytes_read > 0)
+        file->position += bytes_read;
 
-    if (file->position + len > file->de.size)
-        len = file->de.size - file->position;
+    return bytes_read;
+}
 
-    while (bytes_read < len) {
-        int bytes_left;
+/**
+ * Write len bytes from buf into file at its position, growing the file if
+ * need be. Whole sectors go straight from buf to the disk, one request per
+ * run of consecutive clusters. Only a partial sector at either end is read
+ * and modified, in the sector cache, where it stays until it's flushed.
+ *
+ * Nothing but file data is written: the FAT goes out on fat_sync, fat_fsync
+ * or fat_close, FSInfo on fat_sync, and the file's new size only reaches its
+ * dirent on fat_fsync or fat_close.
+ *
+ * Returns the number of bytes written.
+ *
+ * Return of -1 indicates error: a directory, no space, or fs inconsistent.
+ */
+int32_t fat_write(fat_file_t *file, const unsigned char *buf, int32_t len) {
+    int32_t written = _fat_write_at(file, buf, len, file->position);
 
-        ret = _fat_load_file_sector(file);
-        // FIXME: fs_error() function
-        if (ret != FAT_SUCCESS)
-            return -1;
+    if (written > 0)
+        file->position += written;
 
-        bytes_left = 512 - file->offset;
-        if (bytes_read + bytes_left > len)
-            bytes_left = len - bytes_read;
+    return written;
+}
 
-        memcpy(buf + bytes_read, file_buffer + file->offset, bytes_left);
-        bytes_read += bytes_left;
-        file->position += bytes_left;
+/**
+ * Read len bytes from file at offset into buf, like fat_read but leaving the
+ * file's position alone.
+ *
+ * Returns the number of bytes read, 0 at or past EOF, -1 on error.
+ */
+int32_t fat_pread(fat_file_t *file, unsigned char *buf, int32_t len, off_t offset) {
+    if (offset < 0)
+        return -1;
+    if (offset >= file->de.size)
+        return 0;
 
-        file->offset += bytes_left;
-    }
+    return _fat_read_at(file, buf, len, offset);
+}
 
-    return bytes_read;
+/**
+ * Write len bytes from buf into file at offset, like fat_write but leaving
+ * the file's position alone. Writing past the end of the file fills the gap
+ * with zeros.
+ *
+ * Returns the number of bytes written, -1 on error.
+ */
+int32_t fat_pwrite(fat_file_t *file, const unsigned char *buf, int32_t len, off_t offset) {
+    if (offset < 0 || offset > 0xffffffff)
+        return -1;
+
+    return _fat_write_at(file, buf, len, offset);
 }
 
 /**
- * Seek to absolute position in file.
- * Returns:
- *  FAT_SUCCESS on success
- *  FAT_INCONSISTENT if the file system needs to be checked
+ * Read from file at its position into iovcnt buffers, filling each in turn,
+ * like readv. This is a convenience over calling fat_read per buffer, it
+ * isn't any faster: only buffers that follow each other in memory are read
+ * as one.
+ *
+ * Returns the number of bytes read, 0 at EOF, -1 on error or if the
+ * buffers add up to more than 2 GB.
  */
-static int _fat_seek(fat_file_t *file, uint32_t position) {
-    uint32_t bytes_per_clus = fat_fs.sect_per_clus * 512;
-    uint32_t seek_left = position;
+int32_t fat_readv(fat_file_t *file, const fat_iovec_t *iov, int iovcnt) {
+    return _fat_vector(file, iov, iovcnt, 0);
+}
 
-    // trunc position
-    if (position > file->de.size) position = file->de.size;
+/**
+ * Write iovcnt buffers into file at its position, one after the other, like
+ * writev. This is a convenience over calling fat_write per buffer, only
+ * buffers that follow each other in memory are written as one.
+ *
+ * Returns the number of bytes written, -1 on error or if the buffers add up
+ * to more than 2 GB.
+ */
+int32_t fat_writev(fat_file_t *file, const fat_iovec_t *iov, int iovcnt) {
+    return _fat_vector(file, iov, iovcnt, 1);
+}
 
-    file->sector = 0;
+/**
+ * Get where a file's data is on disk, as up to max runs of consecutive
+ * sectors, starting with the sector holding byte *offset. *offset is moved
+ * past the last run returned, so starting at 0 and calling again until
+ * nothing is returned walks the whole file. A file is contiguous if asking
+ * for two runs from offset 0 gets one.
+ *
+ * Runs stop at the last sector holding data, clusters reserved past the end
+ * aren't included. Space fat_preallocate added isn't zeroed on disk until
+ * fat_close.
+ *
+ * Returns the number of runs, 0 when *offset is at the end of the file, -1
+ * if the file system needs to be checked.
+ */
+int fat_get_extents(fat_file_t *file, uint32_t *offset, fat_file_extent_t *extents, int max) {
+    uint32_t sector = *offset / 512, cluster, run, count;
+    uint32_t end = file->de.size / 512 + (file->de.size % 512 != 0);
+    int n;
 
-    uint32_t cluster = file->de.start_cluster;
+    if (*offset >= file->de.size)
+        return 0;
 
-    while (seek_left > 512) {
-        // not on the right cluster yet, load the next one
-        if (seek_left > bytes_per_clus) {
-            cluster = fat_get_fat(cluster);
-            if (cluster >= 0x0ffffff8)
-                return FAT_INCONSISTENT;
+    for (n = 0; n < max && sector < end; ++n) {
+        if (_fat_file_cluster(file, sector / fat_fs.sect_per_clus, &cluster, &run) != FAT_SUCCESS)
+            return -1;
 
-            seek_left -= bytes_per_clus;
-        }
+        count = run * fat_fs.sect_per_clus - sector % fat_fs.sect_per_clus;
+        if (count > end - sector)
+            count = end - sector;
 
-        // found the right cluster, so find the right sector and offset
-        else {
-            file->cluster = cluster;
-            while (seek_left >= 512) {
-                seek_left -= 512;
-                ++file->sector;
-            }
-        }
+        extents[n].offset = sector * 512;
+        extents[n].sector = CLUSTER_TO_SECTOR(cluster) + sector % fat_fs.sect_per_clus;
+        extents[n].count = count;
+
+        sector += count;
     }
 
-    file->cluster = cluster;
-    file->offset = seek_left;
-    file->position = position;
-    return FAT_SUCCESS;
+    // the end of a file just short of 4 GB is past the last 32 bit offset
+    if (n > 0)
+        *offset = sector < end ? sector * 512 : file->de.size;
+
+    return n;
 }
 
 /**
@@ -190,7 +298,6 @@ static int _fat_seek(fat_file_t *file, uint32_t position) {
  * Returns
  *  FAT_SUCCESS on success
  *  FAT_BADINPUT if whence is not one of SEEK_SET, SEEK_CUR, or SEEK_END
- *  FAT_INCONSISTENT if the file system needs to be checked
  */
 int fat_lseek(fat_file_t *file, off_t offset, int whence) {
     off_t position;
@@ -244,7 +351,65 @@ int fat_lseek(fat_file_t *file, off_t offset, int whence) {
         position = file->de.size;
     }
 
-    return _fat_seek(file, position);
+    file->position = position;
+    return FAT_SUCCESS;
+}
+
+/**
+ * Reserve clusters for the first size bytes of a file, in as few runs as the
+ * free space allows, so it can grow without the allocator getting involved.
+ *
+ * Without flags the file's size doesn't change; the clusters past its end
+ * stay reserved while the file is open, and fat_close gives back any it
+ * didn't grow into. With FAT_PREALLOC_EXTEND the file grows to size too. The
+ * new part reads as zeros straight away, but is only zeroed on disk by
+ * fat_close, and until then the dirent only covers what's been written.
+ *
+ * Returns:
+ *  FAT_SUCCESS on success
+ *  FAT_BADINPUT if the file is a directory
+ *  FAT_NOSPACE if the file system is full
+ *  FAT_IOERROR if writing the FAT or dirent failed
+ *  FAT_INCONSISTENT if the file system needs to be checked
+ */
+int fat_preallocate(fat_file_t *file, uint32_t size, int flags) {
+    uint32_t bytes_per_clus = fat_fs.sect_per_clus * 512;
+    uint32_t want = size > 0 ? (size - 1) / bytes_per_clus + 1 : 0;
+    fat_dirent de;
+    int ret;
+
+    if (file->dir)
+        return FAT_BADINPUT;
+
+    ret = _fat_grow_chain(file, want);
+    if (ret != FAT_SUCCESS)
+        return ret;
+
+    file->reserved = 1;
+
+    if ((flags & FAT_PREALLOC_EXTEND) && size > file->de.size) {
+        if (file->zero_from > file->de.size)
+            file->zero_from = file->de.size;
+        file->de.size = size;
+        file->dirty = 1;
+    }
+
+    // the dirent points at the chain but only covers what's been written,
+    // the new part gets in once fat_close has zeroed it
+    de = file->de;
+    if (de.size > file->zero_from)
+        de.size = file->zero_from;
+
+    if (fat_cache_flush(FAT_CACHE_DATA) != 0 || fat_flush_fat() != 0)
+        return FAT_IOERROR;
+
+    _fat_write_dirent(&de);
+    fat_dcache_invalidate_dirent(&de);
+
+    if (_fat_flush_dir() != 0)
+        return FAT_IOERROR;
+
+    return FAT_SUCCESS;
 }
 
 /**
@@ -470,41 +635,554 @@ int fat_recurse_path(const char * const path, fat_dirent *dirent, int *ret_type,
     return ret;
 }
 
-// load the current sector from the file
-// cut & paste code from _dir_load_sector :(
+// reset everything about an open file but its dirent, as if just opened.
+// anything it had allocated must already be freed
+static void _fat_file_init(fat_file_t *file) {
+    file->position = 0;
+
+    file->extents = NULL;
+    file->extent_count = 0;
+    file->extent_alloc = 0;
+    file->extent_last = 0;
+
+    file->map = NULL;
+    file->buffer_valid = 0;
+    file->zero_from = 0xffffffff;
+    file->reserved = 0;
+    file->dirty = 0;
+}
+
+// get a sector of the file's data into the file's own buffer, unless it's
+// there already, and return a pointer to it
+static unsigned char *_fat_sector_data(fat_file_t *file, uint32_t sector) {
+    // TODO dirty file cluster?
+    if (!file->buffer_valid || file->buffer_sector != sector || file->buffer_gen != fat_data_gen) {
+        file->map = cfMapSector(sector);
+        if (file->map == NULL)
+            memcpy(file->buffer, fat_cache_get(FAT_CACHE_DATA, sector), 512);
+
+        file->buffer_sector = sector;
+        file->buffer_gen = fat_data_gen;
+        file->buffer_valid = 1;
+    }
+
+    return file->map ? file->map : file->buffer;
+}
+
+// start reading the cluster after the index'th one of the file in the
+// background
+static void _fat_readahead(fat_file_t *file, uint32_t index) {
+    uint32_t cluster, run, last = file->extent_last;
+
+    // don't bother finding the next cluster if nobody will fetch it
+    if (fat_dev->prefetch == NULL)
+        return;
+
+    if (_fat_file_cluster(file, index + 1, &cluster, &run) == FAT_SUCCESS)
+        cfPrefetch(CLUSTER_TO_SECTOR(cluster), fat_fs.sect_per_clus);
+
+    // the next read is probably still in the extent the last one was
+    file->extent_last = last;
+}
+
+// walk the file's cluster chain and record it as a list of extents
 //
 // returns:
 //  FAT_SUCCESS         success
+//  FAT_NOSPACE         out of memory
 //  FAT_INCONSISTENT    fs inconsistent
-static int _fat_load_file_sector(fat_file_t *file) {
-    uint32_t sector;
-    uint32_t fat_entry;
-
-    if (file->offset == 512) {
-        if (file->sector + 1 == fat_fs.sect_per_clus) {
-            // look up the cluster number in the FAT
-            fat_entry = fat_get_fat(file->cluster);
-            if (fat_entry >= 0x0ffffff8) // last cluster
-                return FAT_INCONSISTENT;
-
-            file->cluster = fat_entry;
-            file->sector = 0;
-            file->offset = 0;
+static int _fat_build_extents(fat_file_t *file) {
+    free(file->extents);
+    file->extents = NULL;
+    file->extent_count = 0;
+    file->extent_alloc = 0;
+    file->extent_last = 0;
+
+    return _fat_add_extents(file, file->de.start_cluster, 0);
+}
+
+// add the chain from cluster onwards, the index'th cluster of the file, to
+// the end of the file's extent map. the map is dropped on failure
+//
+// returns:
+//  FAT_SUCCESS         success
+//  FAT_NOSPACE         out of memory
+//  FAT_INCONSISTENT    fs inconsistent
+static int _fat_add_extents(fat_file_t *file, uint32_t cluster, uint32_t index) {
+    fat_extent_t *e = NULL, *grown;
+    int ret = FAT_SUCCESS;
+
+    if (file->extent_count > 0)
+        e = &file->extents[file->extent_count - 1];
+
+    while (cluster >= 2 && cluster < 0x0ffffff8) {
+        // a chain longer than the volume has a cycle in it, and one leading
+        // past the end of the FAT is just as damaged
+        if (index > fat_fs.total_clusters || cluster >= fat_fs.total_clusters + 2) {
+            ret = FAT_INCONSISTENT;
+            break;
         }
+
+        // extend the current extent or start a new one
+        if (e != NULL && cluster == e->cluster + e->length)
+            ++e->length;
         else {
-            ++file->sector;
-            file->offset = 0;
+            if (file->extent_count == file->extent_alloc) {
+                file->extent_alloc = file->extent_alloc ? file->extent_alloc * 2 : 8;
+                grown = realloc(file->extents, file->extent_alloc * sizeof(fat_extent_t));
+                if (grown == NULL) {
+                    ret = FAT_NOSPACE;
+                    break;
+                }
+                file->extents = grown;
+            }
+
+            e = &file->extents[file->extent_count++];
+            e->file_cluster = index;
+            e->cluster = cluster;
+            e->length = 1;
         }
+
+        cluster = fat_get_fat(cluster);
+        ++index;
     }
 
-    // sector may or may not have changed, but buffering makes this efficient
-    sector = CLUSTER_TO_SECTOR(file->cluster) + file->sector;
+    if (ret != FAT_SUCCESS) {
+        free(file->extents);
+        file->extents = NULL;
+        file->extent_count = 0;
+        file->extent_alloc = 0;
+        return ret;
+    }
 
-    // TODO dirty file cluster?
-    if (file_buffer_sector != sector) {
-        cfReadSector(file_buffer, sector);
-        file_buffer_sector = sector;
+    file->extent_gen = fat_chain_gen;
+
+    return FAT_SUCCESS;
+}
+
+// make the file's chain at least want clusters long, allocating the rest
+// after its last cluster. the FAT is changed in memory only
+//
+// returns:
+//  FAT_SUCCESS         success
+//  FAT_NOSPACE         file system full
+//  FAT_INCONSISTENT    fs inconsistent
+static int _fat_grow_chain(fat_file_t *file, uint32_t want) {
+    uint32_t count = 0, last = 0, first;
+    fat_extent_t *e;
+    int ret;
+
+    // the extent map knows where the chain ends
+    if (file->extents == NULL || file->extent_gen != fat_chain_gen) {
+        ret = _fat_build_extents(file);
+        if (ret != FAT_SUCCESS)
+            return ret;
+    }
+
+    if (file->extent_count > 0) {
+        e = &file->extents[file->extent_count - 1];
+        count = e->file_cluster + e->length;
+        last = e->cluster + e->length - 1;
     }
 
+    if (count >= want)
+        return FAT_SUCCESS;
+
+    if (want - count > fat_fs.free_clusters)
+        return FAT_NOSPACE;
+
+    ret = fat_allocate_clusters(last, want - count, &first);
+    if (ret == FAT_NOSPACE)
+        return FAT_INCONSISTENT;
+    if (ret != FAT_SUCCESS)
+        return ret;
+
+    if (last != 0)
+        first = fat_get_fat(last);
+    else
+        file->de.start_cluster = first;
+
+    // other handles rebuild their maps, this one only needs the new part
+    ++fat_chain_gen;
+    return _fat_add_extents(file, first, count);
+}
+
+// find the disk cluster holding the index'th cluster of a file, using the
+// file's extent map. if run isn't NULL it gets the number of clusters from
+// there to the end of the extent
+//
+// returns:
+//  FAT_SUCCESS         success, cluster in *cluster
+//  FAT_NOSPACE         out of memory
+//  FAT_INCONSISTENT    fs inconsistent
+static int _fat_file_cluster(fat_file_t *file, uint32_t index, uint32_t *cluster, uint32_t *run) {
+    uint32_t low, high, mid;
+    fat_extent_t *e;
+    int ret;
+
+    // no need for the map to find the first cluster
+    if (index == 0 && run == NULL) {
+        *cluster = file->de.start_cluster;
+        return FAT_SUCCESS;
+    }
+
+    if (file->extents == NULL || file->extent_gen != fat_chain_gen) {
+        ret = _fat_build_extents(file);
+        if (ret != FAT_SUCCESS)
+            return ret;
+    }
+
+    if (file->extent_count == 0)
+        return FAT_INCONSISTENT;
+
+    // nearby lookups land in the extent the last one did, or the next one
+    low = file->extent_last;
+    if (low < file->extent_count && index >= file->extents[low].file_cluster + file->extents[low].length)
+        ++low;
+
+    if (low >= file->extent_count || index < file->extents[low].file_cluster ||
+            index >= file->extents[low].file_cluster + file->extents[low].length) {
+        // binary search for the last extent starting at or before index
+        low = 0;
+        high = file->extent_count;
+        while (high - low > 1) {
+            mid = low + (high - low) / 2;
+            if (file->extents[mid].file_cluster <= index)
+                low = mid;
+            else
+                high = mid;
+        }
+    }
+
+    file->extent_last = low;
+    e = &file->extents[low];
+    if (index - e->file_cluster >= e->length)
+        return FAT_INCONSISTENT;
+
+    *cluster = e->cluster + (index - e->file_cluster);
+    if (run != NULL)
+        *run = e->length - (index - e->file_cluster);
     return FAT_SUCCESS;
 }
+
+// write zeros over the part of the file that fat_preallocate extended it by.
+// partial sectors go through the sector cache, whole ones are cleared in one
+// request per cluster
+//
+// returns:
+//  FAT_SUCCESS         success
+//  FAT_IOERROR         a write failed
+//  FAT_INCONSISTENT    fs inconsistent
+static int _fat_zero_fill(fat_file_t *file) {
+    uint32_t bytes_per_clus = fat_fs.sect_per_clus * 512;
+    uint32_t pos = file->zero_from, end = file->de.size;
+    uint32_t cluster, sector, count;
+    unsigned char *data;
+    int ret;
+
+    while (pos < end) {
+        ret = _fat_file_cluster(file, pos / bytes_per_clus, &cluster, NULL);
+        if (ret != FAT_SUCCESS)
+            return ret;
+
+        sector = CLUSTER_TO_SECTOR(cluster) + pos % bytes_per_clus / 512;
+
+        // zero the rest of a sector that's partly file data
+        if (pos % 512 != 0 || end - pos < 512) {
+            data = fat_cache_get(FAT_CACHE_DATA, sector);
+            memset(data + pos % 512, 0, 512 - pos % 512);
+            fat_cache_dirty(FAT_CACHE_DATA, sector);
+            pos += 512 - pos % 512;
+            continue;
+        }
+
+        // whole sectors up to the end of the cluster
+        count = (bytes_per_clus - pos % bytes_per_clus) / 512;
+        if (count > (end - pos) / 512)
+            count = (end - pos) / 512;
+
+        fat_cache_invalidate(sector, count);
+        if (cfClearSectors(sector, count) != 0)
+            return FAT_IOERROR;
+        pos += count * 512;
+    }
+
+    if (fat_cache_flush(FAT_CACHE_DATA) != 0)
+        return FAT_IOERROR;
+    ++fat_data_gen;
+
+    file->zero_from = 0xffffffff;
+    return FAT_SUCCESS;
+}
+
+// write back an open file's data, chain and dirent, zeroing whatever
+// fat_preallocate added first. with trim, also give back the clusters it
+// reserved that the file didn't grow into
+//
+// returns:
+//  FAT_SUCCESS         success
+//  FAT_IOERROR         a write failed
+//  FAT_INCONSISTENT    fs inconsistent
+static int _fat_write_back(fat_file_t *file, int trim) {
+    int ret = FAT_SUCCESS;
+
+    // the dirent can't claim space that still holds someone else's data
+    if (file->zero_from < file->de.size) {
+        ret = _fat_zero_fill(file);
+        if (ret != FAT_SUCCESS)
+            file->de.size = file->zero_from;
+    }
+
+    if (trim && file->reserved) {
+        if (_fat_trim_chain(file) != FAT_SUCCESS)
+            ret = FAT_INCONSISTENT;
+        file->reserved = 0;
+        file->dirty = 1;
+    }
+
+    // data, then the chain, then the dirent that points at it
+    if (file->dirty) {
+        if (fat_cache_flush(FAT_CACHE_DATA) != 0 || fat_flush_fat() != 0)
+            ret = FAT_IOERROR;
+
+        _fat_write_dirent(&file->de);
+        fat_dcache_invalidate_dirent(&file->de);
+        if (_fat_flush_dir() != 0)
+            ret = FAT_IOERROR;
+
+        file->dirty = 0;
+    }
+
+    return ret;
+}
+
+// give back the clusters past the end of the file that fat_preallocate
+// reserved and nothing grew into
+//
+// returns:
+//  FAT_SUCCESS         success
+//  FAT_INCONSISTENT    fs inconsistent
+static int _fat_trim_chain(fat_file_t *file) {
+    uint32_t bytes_per_clus = fat_fs.sect_per_clus * 512;
+    uint32_t need = file->de.size > 0 ? (file->de.size - 1) / bytes_per_clus + 1 : 0;
+    uint32_t last, next;
+    int ret;
+
+    if (need == 0) {
+        next = file->de.start_cluster;
+        file->de.start_cluster = 0;
+    }
+    else {
+        ret = _fat_file_cluster(file, need - 1, &last, NULL);
+        if (ret != FAT_SUCCESS)
+            return ret;
+
+        next = fat_get_fat(last);
+        if (next >= 2 && next < 0x0ffffff7)
+            fat_set_fat(last, 0x0ffffff8);
+    }
+
+    if (next >= 2 && next < 0x0ffffff7) {
+        ++fat_chain_gen;
+        return fat_free_chain(next);
+    }
+
+    return FAT_SUCCESS;
+}
+
+// read up to len bytes from pos into buf, stopping at the end of the file.
+// whole sectors are read straight into buf, one request per extent, the rest
+// goes through the file's own buffer
+//
+// returns the number of bytes read, 0 at or past the end, -1 on error
+static int32_t _fat_read_at(fat_file_t *file, unsigned char *buf, int32_t len, uint32_t pos) {
+    uint32_t bytes_per_clus = fat_fs.sect_per_clus * 512;
+    uint32_t bytes_read = 0, zero_len = 0, cluster, run, sector, count;
+
+    if (len < 0)
+        return -1;
+
+    if (pos >= file->de.size)
+        return 0;
+
+    if (len > file->de.size - pos)
+        len = file->de.size - pos;
+
+    // preallocated space that hasn't been zeroed on disk yet
+    if (pos + len > file->zero_from) {
+        zero_len = pos + len - (pos > file->zero_from ? pos : file->zero_from);
+        len -= zero_len;
+    }
+
+    while (bytes_read < len) {
+        if (_fat_file_cluster(file, pos / bytes_per_clus, &cluster, &run) != FAT_SUCCESS)
+            return -1;
+
+        sector = CLUSTER_TO_SECTOR(cluster) + pos % bytes_per_clus / 512;
+
+        // partial sector
+        if (pos % 512 != 0 || len - bytes_read < 512) {
+            count = 512 - pos % 512;
+            if (count > len - bytes_read)
+                count = len - bytes_read;
+
+            memcpy(buf + bytes_read, _fat_sector_data(file, sector) + pos % 512, count);
+        }
+
+        // whole sectors up to the end of the extent
+        else {
+            count = run * fat_fs.sect_per_clus - pos % bytes_per_clus / 512;
+            if (count > (len - bytes_read) / 512)
+                count = (len - bytes_read) / 512;
+
+            // fat_write may have left some of them in the cache
+            fat_cache_flush(FAT_CACHE_DATA);
+
+            if (cfReadSectors(buf + bytes_read, sector, count) != 0)
+                return -1;
+            count *= 512;
+
+            _fat_readahead(file, (pos + count - 1) / bytes_per_clus);
+        }
+
+        bytes_read += count;
+        pos += count;
+    }
+
+    memset(buf + bytes_read, 0, zero_len);
+
+    return bytes_read + zero_len;
+}
+
+// write len bytes from buf to pos, growing the file if need be. whole
+// sectors go straight to the disk, one request per extent, partial ones are
+// modified in the sector cache
+//
+// returns the number of bytes written, -1 on error
+static int32_t _fat_write_at(fat_file_t *file, const unsigned char *buf, int32_t len, uint32_t pos) {
+    uint32_t bytes_per_clus = fat_fs.sect_per_clus * 512;
+    uint32_t written = 0, end, cluster, run, sector, count;
+    unsigned char *data;
+
+    if (len < 0 || file->dir)
+        return -1;
+    if (len == 0)
+        return 0;
+
+    end = pos + len;
+    if (end < pos)
+        return -1;
+
+    // a gap past the end reads as zeros, like space fat_preallocate added
+    if (pos > file->de.size) {
+        if (_fat_grow_chain(file, (pos - 1) / bytes_per_clus + 1) != FAT_SUCCESS)
+            return -1;
+
+        if (file->zero_from > file->de.size)
+            file->zero_from = file->de.size;
+        file->de.size = pos;
+        file->dirty = 1;
+    }
+
+    // writing past the unzeroed part of the file would leave a gap fat_close
+    // zeros after the data's written. writing from the start of it just
+    // moves it up
+    if (pos > file->zero_from && _fat_zero_fill(file) != FAT_SUCCESS)
+        return -1;
+
+    if (end > file->de.size && _fat_grow_chain(file, (end - 1) / bytes_per_clus + 1) != FAT_SUCCESS)
+        return -1;
+
+    file->dirty = 1;
+
+    while (written < len) {
+        if (_fat_file_cluster(file, pos / bytes_per_clus, &cluster, &run) != FAT_SUCCESS)
+            return -1;
+
+        sector = CLUSTER_TO_SECTOR(cluster) + pos % bytes_per_clus / 512;
+
+        // partial sector
+        if (pos % 512 != 0 || len - written < 512) {
+            count = 512 - pos % 512;
+            if (count > len - written)
+                count = len - written;
+
+            data = fat_cache_get(FAT_CACHE_DATA, sector);
+            memcpy(data + pos % 512, buf + written, count);
+            fat_cache_dirty(FAT_CACHE_DATA, sector);
+        }
+
+        // whole sectors up to the end of the extent
+        else {
+            count = run * fat_fs.sect_per_clus - pos % bytes_per_clus / 512;
+            if (count > (len - written) / 512)
+                count = (len - written) / 512;
+
+            fat_cache_invalidate(sector, count);
+            if (cfWriteSectors((unsigned char *)buf + written, sector, count) != 0)
+                return -1;
+            count *= 512;
+        }
+
+        written += count;
+        pos += count;
+    }
+
+    // open files have to reload their sectors
+    ++fat_data_gen;
+
+    if (end > file->de.size)
+        file->de.size = end;
+
+    if (end > file->zero_from)
+        file->zero_from = end < file->de.size ? end : 0xffffffff;
+
+    return written;
+}
+
+// read or write a list of buffers at the file's position and move past
+// them. runs of buffers that are adjacent in memory are done in one go,
+// otherwise each buffer is its own _fat_read_at or _fat_write_at. those
+// find their runs in the file's extent map, so nothing walks the chain
+// again, and a sector split between two buffers is only read once because
+// it stays in the file's buffer, or the sector cache when writing
+//
+// returns the number of bytes done, -1 on error
+static int32_t _fat_vector(fat_file_t *file, const fat_iovec_t *iov, int iovcnt, int write) {
+    uint32_t total = 0, len;
+    unsigned char *base;
+    int32_t done = 0, ret;
+    int i;
+
+    if (iovcnt < 0)
+        return -1;
+
+    for (i = 0; i < iovcnt; ++i) {
+        total += iov[i].len;
+        if (iov[i].len > 0x7fffffff || total > 0x7fffffff)
+            return -1;
+    }
+
+    for (i = 0; i < iovcnt; ) {
+        base = iov[i].base;
+        len = iov[i].len;
+        for (++i; i < iovcnt && (unsigned char *)iov[i].base == base + len; ++i)
+            len += iov[i].len;
+
+        if (write)
+            ret = _fat_write_at(file, base, len, file->position);
+        else
+            ret = _fat_read_at(file, base, len, file->position);
+        if (ret < 0)
+            return -1;
+
+        file->position += ret;
+        done += ret;
+
+        // end of file
+        if (ret < len)
+            break;
+    }
+
+    return done;
+}
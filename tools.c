@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "tools.h"
+
+/*
+ * Helpers shared by analyze and defrag, so the two agree on which files
+ * there are and how fragmented each one is.
+ */
+
+/**
+ * Call fn for every file in a directory tree, with its path from the root.
+ * Directories, volume labels and the dot entries aren't passed to fn.
+ */
+void walk_files(uint32_t dir_cluster, const char *path, walk_fn fn) {
+    fat_dirent de;
+    char sub[1024];
+
+    fat_sub_dirent(dir_cluster, &de);
+    while (fat_readdir(&de) > 0) {
+        if (de.volume_label || strcmp(de.name, ".") == 0 || strcmp(de.name, "..") == 0)
+            continue;
+
+        snprintf(sub, sizeof(sub), "%s/%s", path, de.name);
+
+        if (de.directory) {
+            if (de.start_cluster >= 2)
+                walk_files(de.start_cluster, sub, fn);
+            continue;
+        }
+
+        fn(sub, &de);
+    }
+}
+
+/**
+ * Count the clusters holding a file's data and the runs of consecutive
+ * clusters they're in, the same runs fat_get_extents hands out. Anything
+ * chained past the end of the file isn't counted.
+ *
+ * Returns 0 on success, -1 if the chain loops or is too short for the size.
+ */
+int file_layout(fat_dirent *de, uint32_t *clusters, uint32_t *extents) {
+    uint32_t bytes_per_clus = fat_fs.sect_per_clus * 512, offset = 0;
+    fat_file_extent_t runs[64];
+    fat_file_t file;
+    int n;
+
+    *clusters = de->size / bytes_per_clus + (de->size % bytes_per_clus != 0);
+    *extents = 0;
+
+    fat_open_from_dirent(&file, de);
+    while ((n = fat_get_extents(&file, &offset, runs, 64)) > 0)
+        *extents += n;
+    fat_close(&file);
+
+    return n < 0 ? -1 : 0;
+}
@@ -0,0 +1,15 @@
+#ifndef __TOOLS_H__
+#define __TOOLS_H__
+
+#include "common.h"
+
+/*
+ * Shared by the offline tools
+ */
+
+typedef void (*walk_fn)(const char *path, fat_dirent *de);
+
+void walk_files(uint32_t dir_cluster, const char *path, walk_fn fn);
+int file_layout(fat_dirent *de, uint32_t *clusters, uint32_t *extents);
+
+#endif /* __TOOLS_H__ */
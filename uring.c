@@ -0,0 +1,485 @@
+#ifdef LINUX
+#define _GNU_SOURCE // fallocate
+#endif
+
+#include "common.h"
+
+#ifdef LINUX
+
+/*******************************
+ * io_uring-based CF functions *
+ ******************************/
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// only build the real thing if the kernel headers know about io_uring
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES       64
+#define URING_SLOTS         32  // prefetches in flight or waiting to be used
+#define URING_SLOT_SECTORS  128 // largest prefetch
+
+#define URING_SYNC          0   // user_data for synchronous requests
+
+enum {
+    SLOT_FREE,
+    SLOT_INFLIGHT,
+    SLOT_DONE
+};
+
+// a prefetched run of sectors
+typedef struct _uring_slot_t {
+    int state;
+    int result;
+    uint32_t lba;
+    uint32_t count;
+    unsigned char *buf;
+} uring_slot_t;
+
+typedef struct _uring_dev_t {
+    fat_dev_t dev;
+    int fd;
+    int ring_fd;
+
+    // submission queue
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    // completion queue, may share the mapping with the submission queue
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    uring_slot_t slots[URING_SLOTS];
+    unsigned next_victim;
+
+    // result of the single outstanding synchronous request
+    int sync_done;
+    int sync_result;
+} uring_dev_t;
+
+/**
+ * Queue up a read or write and tell the kernel about it.
+ */
+static int _uring_submit(uring_dev_t *udev, int op, unsigned char *buf, off_t offset, size_t len, uint64_t user_data) {
+    unsigned tail = *udev->sq_tail;
+    unsigned index = tail & *udev->sq_mask;
+    struct io_uring_sqe *sqe = &udev->sqes[index];
+    int ret;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = op;
+    sqe->fd = udev->fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    udev->sq_array[index] = index;
+    __atomic_store_n(udev->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    do
+        ret = syscall(__NR_io_uring_enter, udev->ring_fd, 1, 0, 0, NULL, 0);
+    while (ret < 0 && errno == EINTR);
+
+    return ret == 1 ? 0 : -1;
+}
+
+/**
+ * Handle every completion that's ready. If there are none and wait is set,
+ * block until there's at least one.
+ *
+ * Returns 0 on success, -1 if waiting failed.
+ */
+static int _uring_reap(uring_dev_t *udev, int wait) {
+    unsigned head, tail;
+    struct io_uring_cqe *cqe;
+    uring_slot_t *slot;
+
+    while (1) {
+        head = *udev->cq_head;
+        tail = __atomic_load_n(udev->cq_tail, __ATOMIC_ACQUIRE);
+        if (head != tail)
+            break;
+
+        if (!wait)
+            return 0;
+
+        if (syscall(__NR_io_uring_enter, udev->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            return -1;
+    }
+
+    for ( ; head != tail; ++head) {
+        cqe = &udev->cqes[head & *udev->cq_mask];
+
+        if (cqe->user_data == URING_SYNC) {
+            udev->sync_result = cqe->res;
+            udev->sync_done = 1;
+        }
+        else {
+            slot = &udev->slots[cqe->user_data - 1];
+            slot->result = cqe->res == slot->count * 512 ? 0 : -1;
+            slot->state = SLOT_DONE;
+        }
+    }
+
+    __atomic_store_n(udev->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Do a read or write through the ring and wait for it to finish.
+ */
+static int _uring_sync(uring_dev_t *udev, int op, unsigned char *buf, uint32_t lba, uint32_t count) {
+    off_t offset = (off_t)lba * 512;
+    size_t left = (size_t)count * 512;
+
+    while (left > 0) {
+        udev->sync_done = 0;
+        if (_uring_submit(udev, op, buf, offset, left, URING_SYNC) != 0)
+            return -1;
+
+        while (!udev->sync_done)
+            if (_uring_reap(udev, 1) != 0)
+                return -1;
+
+        if (udev->sync_result == -EINTR || udev->sync_result == -EAGAIN)
+            continue;
+
+        // error or short image
+        if (udev->sync_result <= 0)
+            return -1;
+
+        buf += udev->sync_result;
+        offset += udev->sync_result;
+        left -= udev->sync_result;
+    }
+
+    return 0;
+}
+
+/**
+ * Find a prefetch that covers a whole range of sectors.
+ */
+static uring_slot_t *_uring_find(uring_dev_t *udev, uint32_t lba, uint32_t count) {
+    int i;
+    uring_slot_t *slot;
+
+    for (i = 0; i < URING_SLOTS; ++i) {
+        slot = &udev->slots[i];
+        if (slot->state != SLOT_FREE && lba >= slot->lba && lba + count <= slot->lba + slot->count)
+            return slot;
+    }
+
+    return NULL;
+}
+
+/**
+ * Throw away prefetches that overlap a range of sectors, waiting for any
+ * that are still in flight.
+ *
+ * Returns 0 on success, -1 if waiting failed.
+ */
+static int _uring_invalidate(uring_dev_t *udev, uint32_t lba, uint32_t count) {
+    int i;
+    uring_slot_t *slot;
+
+    for (i = 0; i < URING_SLOTS; ++i) {
+        slot = &udev->slots[i];
+        if (slot->state == SLOT_FREE || lba >= slot->lba + slot->count || slot->lba >= lba + count)
+            continue;
+
+        while (slot->state == SLOT_INFLIGHT)
+            if (_uring_reap(udev, 1) != 0)
+                return -1;
+        slot->state = SLOT_FREE;
+    }
+
+    return 0;
+}
+
+static int _uring_read_sectors(fat_dev_t *dev, unsigned char *buffer, uint32_t lba, uint32_t count) {
+    uring_dev_t *udev = (uring_dev_t *)dev;
+    uring_slot_t *slot;
+
+    // pick up any prefetches that have finished
+    _uring_reap(udev, 0);
+
+    slot = _uring_find(udev, lba, count);
+    if (slot != NULL) {
+        while (slot->state == SLOT_INFLIGHT)
+            if (_uring_reap(udev, 1) != 0)
+                return -1;
+
+        if (slot->result == 0) {
+            memcpy(buffer, slot->buf + (lba - slot->lba) * 512, (size_t)count * 512);
+            return 0;
+        }
+
+        // prefetch failed, try it the hard way
+        slot->state = SLOT_FREE;
+    }
+
+    return _uring_sync(udev, IORING_OP_READ, buffer, lba, count);
+}
+
+static int _uring_write_sectors(fat_dev_t *dev, unsigned char *buffer, uint32_t lba, uint32_t count) {
+    uring_dev_t *udev = (uring_dev_t *)dev;
+
+    if (_uring_invalidate(udev, lba, count) != 0)
+        return -1;
+    return _uring_sync(udev, IORING_OP_WRITE, buffer, lba, count);
+}
+
+/**
+ * Start reading a run of sectors in the background. Reads that land inside
+ * the run are served from memory once it finishes.
+ */
+static void _uring_prefetch(fat_dev_t *dev, uint32_t lba, uint32_t count) {
+    uring_dev_t *udev = (uring_dev_t *)dev;
+    uring_slot_t *slot = NULL;
+    int i;
+
+    if (count > URING_SLOT_SECTORS)
+        count = URING_SLOT_SECTORS;
+
+    _uring_reap(udev, 0);
+
+    // already on its way
+    if (_uring_find(udev, lba, count) != NULL)
+        return;
+
+    // take a free slot, otherwise the oldest finished one
+    for (i = 0; i < URING_SLOTS && slot == NULL; ++i)
+        if (udev->slots[i].state == SLOT_FREE)
+            slot = &udev->slots[i];
+
+    for (i = 0; i < URING_SLOTS && slot == NULL; ++i) {
+        uring_slot_t *victim = &udev->slots[udev->next_victim];
+        udev->next_victim = (udev->next_victim + 1) % URING_SLOTS;
+        if (victim->state == SLOT_DONE)
+            slot = victim;
+    }
+
+    // everything's in flight, don't bother
+    if (slot == NULL)
+        return;
+
+    slot->lba = lba;
+    slot->count = count;
+    slot->state = SLOT_INFLIGHT;
+    if (_uring_submit(udev, IORING_OP_READ, slot->buf, (off_t)lba * 512, (size_t)count * 512, slot - udev->slots + 1) != 0)
+        slot->state = SLOT_FREE;
+}
+
+static int _uring_flush(fat_dev_t *dev) {
+    return fdatasync(((uring_dev_t *)dev)->fd);
+}
+
+static int _uring_discard(fat_dev_t *dev, uint32_t lba, uint32_t count) {
+    uring_dev_t *udev = (uring_dev_t *)dev;
+
+    if (_uring_invalidate(udev, lba, count) != 0)
+        return -1;
+    return fallocate(udev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            (off_t)lba * 512, (off_t)count * 512);
+}
+
+static int _uring_geometry(fat_dev_t *dev, uint32_t *total_sectors) {
+    struct stat st;
+
+    // size of anything but an image is unknown
+    if (fstat(((uring_dev_t *)dev)->fd, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    *total_sectors = st.st_size / 512;
+    return 0;
+}
+
+static void _uring_close(fat_dev_t *dev) {
+    uring_dev_t *udev = (uring_dev_t *)dev;
+    int i;
+
+    // let the kernel finish with our buffers before freeing them
+    _uring_invalidate(udev, 0, 0xffffffff);
+
+    for (i = 0; i < URING_SLOTS; ++i)
+        free(udev->slots[i].buf);
+
+    munmap(udev->sqes, udev->sqes_size);
+    if (udev->cq_ring != udev->sq_ring)
+        munmap(udev->cq_ring, udev->cq_ring_size);
+    munmap(udev->sq_ring, udev->sq_ring_size);
+
+    close(udev->ring_fd);
+    close(udev->fd);
+    free(udev);
+}
+
+/**
+ * Check the kernel can do plain reads and writes through the ring. Kernels
+ * before 5.6 have io_uring but not these, and fail every request with them.
+ *
+ * Returns 0 if both are supported, -1 if not.
+ */
+static int _uring_probe(int ring_fd) {
+    struct io_uring_probe *probe;
+    int ret = -1;
+
+    probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+        return -1;
+
+    // older kernels don't know how to probe either
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) >= 0 &&
+            probe->last_op >= IORING_OP_READ && probe->last_op >= IORING_OP_WRITE &&
+            (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+        ret = 0;
+
+    free(probe);
+    return ret;
+}
+
+/**
+ * Set up the submission and completion rings.
+ *
+ * Returns 0 on success, -1 if the kernel won't give us a ring it can read
+ * and write through.
+ */
+static int _uring_setup(uring_dev_t *udev) {
+    struct io_uring_params p;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    udev->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (udev->ring_fd < 0)
+        return -1;
+
+    if (_uring_probe(udev->ring_fd) != 0)
+        goto error_fd;
+
+    udev->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    udev->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    // newer kernels map both rings in one go
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (udev->cq_ring_size > udev->sq_ring_size)
+            udev->sq_ring_size = udev->cq_ring_size;
+        udev->cq_ring_size = udev->sq_ring_size;
+    }
+
+    udev->sq_ring = mmap(NULL, udev->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, udev->ring_fd, IORING_OFF_SQ_RING);
+    if (udev->sq_ring == MAP_FAILED)
+        goto error_fd;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        udev->cq_ring = udev->sq_ring;
+    else {
+        udev->cq_ring = mmap(NULL, udev->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, udev->ring_fd, IORING_OFF_CQ_RING);
+        if (udev->cq_ring == MAP_FAILED)
+            goto error_sq;
+    }
+
+    udev->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    udev->sqes = mmap(NULL, udev->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, udev->ring_fd, IORING_OFF_SQES);
+    if (udev->sqes == MAP_FAILED)
+        goto error_cq;
+
+    udev->sq_tail = (unsigned *)((char *)udev->sq_ring + p.sq_off.tail);
+    udev->sq_mask = (unsigned *)((char *)udev->sq_ring + p.sq_off.ring_mask);
+    udev->sq_array = (unsigned *)((char *)udev->sq_ring + p.sq_off.array);
+
+    udev->cq_head = (unsigned *)((char *)udev->cq_ring + p.cq_off.head);
+    udev->cq_tail = (unsigned *)((char *)udev->cq_ring + p.cq_off.tail);
+    udev->cq_mask = (unsigned *)((char *)udev->cq_ring + p.cq_off.ring_mask);
+    udev->cqes = (struct io_uring_cqe *)((char *)udev->cq_ring + p.cq_off.cqes);
+
+    for (i = 0; i < URING_SLOTS; ++i) {
+        udev->slots[i].buf = malloc(URING_SLOT_SECTORS * 512);
+        if (udev->slots[i].buf == NULL)
+            err(1, "Couldn't allocate prefetch buffers");
+    }
+
+    return 0;
+
+    // undo the mappings in reverse order
+error_cq:
+    if (udev->cq_ring != udev->sq_ring)
+        munmap(udev->cq_ring, udev->cq_ring_size);
+error_sq:
+    munmap(udev->sq_ring, udev->sq_ring_size);
+error_fd:
+    close(udev->ring_fd);
+    return -1;
+}
+
+/**
+ * Open a FAT disk image using io_uring. Prefetches issued by the file system
+ * are kept in flight in the background while the caller carries on.
+ *
+ * If the kernel doesn't support io_uring, falls back to fat_pread_open().
+ */
+fat_dev_t *fat_uring_open(char *filename) {
+    uring_dev_t *udev;
+
+    udev = calloc(1, sizeof(uring_dev_t));
+    if (udev == NULL)
+        err(1, "Couldn't allocate device");
+
+    if (_uring_setup(udev) != 0) {
+        free(udev);
+        return fat_pread_open(filename);
+    }
+
+    udev->fd = open(filename, O_RDWR);
+    if (udev->fd < 0)
+        err(1, "Couldn't open %s for reading", filename);
+
+    udev->dev.read_sectors = _uring_read_sectors;
+    udev->dev.write_sectors = _uring_write_sectors;
+    udev->dev.flush = _uring_flush;
+    udev->dev.discard = _uring_discard;
+    udev->dev.geometry = _uring_geometry;
+    udev->dev.close = _uring_close;
+    udev->dev.prefetch = _uring_prefetch;
+
+    return &udev->dev;
+}
+
+#else
+
+/**
+ * No io_uring on this system, use the synchronous backend.
+ */
+fat_dev_t *fat_uring_open(char *filename) {
+    return fat_pread_open(filename);
+}
+
+#endif /* HAVE_IO_URING */
+
+#endif /* LINUX */